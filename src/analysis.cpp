@@ -0,0 +1,198 @@
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "analysis.h"
+#include "trajectory.h"
+#include "journal.h"
+
+// rethrows the first exception caught by a worker thread, once they have all been joined
+static void rethrowFirst (const vguard<exception_ptr>& error) {
+  for (const auto& e: error)
+    if (e)
+      rethrow_exception (e);
+}
+
+bool FrameAnalysis::isLinear (const Board& board) {
+  for (size_t i = 0; i < board.unit.size(); ++i) {
+    const Unit& u = board.unit[i];
+    if ((i > 0 && u.prev != (int) i - 1) || (i + 1 < board.unit.size() && u.next != (int) i + 1))
+      return false;
+  }
+  return true;
+}
+
+void FrameAnalysis::add (const Board& board, long move) {
+  ++frames;
+  if (pairs)
+    board.countPairs (pairCount);
+  if (strands)
+    for (const auto& sf: board.sequenceFreqs())
+      strandCount[sf.first] += sf.second;
+  if (folds && isLinear (board))
+    ++foldCount[board.foldString()];
+  if (series)
+    energyRg[move] = vguard<double> { board.foldEnergy(), board.unitRadiusOfGyration() };
+}
+
+void FrameAnalysis::merge (const FrameAnalysis& a) {
+  frames += a.frames;
+  for (const auto& ij_n: a.pairCount)
+    pairCount[ij_n.first] += ij_n.second;
+  for (const auto& s_n: a.strandCount)
+    strandCount[s_n.first] += s_n.second;
+  for (const auto& f_n: a.foldCount)
+    foldCount[f_n.first] += f_n.second;
+  energyRg.insert (a.energyRg.begin(), a.energyRg.end());
+}
+
+json FrameAnalysis::report (const string& sequence) const {
+  json js;
+  js["frames"] = frames;
+  if (pairs) {
+    json prob = json::object();
+    for (const auto& ij_n: pairCount)
+      prob[to_string(ij_n.first.first)][to_string(ij_n.first.second)] = ij_n.second / frames;
+    js["pairs"] = { { "samples", frames }, { "sequence", sequence }, { "prob", prob } };
+  }
+  if (strands) {
+    json freq = json::object();
+    for (const auto& s_n: strandCount)
+      freq[s_n.first] = (double) s_n.second / frames;
+    js["strands"] = freq;  // mean copies per frame
+  }
+  if (folds && !foldCount.empty()) {
+    json freq = json::object();
+    for (const auto& f_n: foldCount)
+      freq[f_n.first] = (double) f_n.second / frames;
+    js["folds"] = freq;
+  }
+  if (series) {
+    json move = json::array(), energy = json::array(), rg = json::array();
+    for (const auto& m_e: energyRg) {
+      move.push_back (m_e.first);
+      energy.push_back (m_e.second[0]);
+      rg.push_back (m_e.second[1]);
+    }
+    js["series"] = { { "move", move }, { "energy", energy }, { "radiusOfGyration", rg } };
+  }
+  return js;
+}
+
+void analyzeTrajectory (const string& filename, int threads, long stride, FrameAnalysis& total, string& sequence) {
+  TrajectoryReader probe (filename);
+  sequence = probe.bases;
+  const size_t frames = probe.frames();
+  vguard<FrameAnalysis> part (threads, total);
+  vguard<exception_ptr> error (threads);
+  vguard<thread> worker;
+  for (int t = 0; t < threads; ++t)
+    worker.push_back (thread ([&, t] {
+	  try {
+	    const size_t first = frames * t / threads, last = frames * (t + 1) / threads;
+	    if (first >= last)
+	      return;
+	    TrajectoryReader reader (filename);
+	    Board board;
+	    reader.seek (first);
+	    do
+	      if (reader.frame % stride == 0) {
+		reader.board (board);
+		part[t].add (board, reader.move (reader.frame));
+	      }
+	    while (reader.frame + 1 < last && reader.nextFrame());
+	  } catch (...) {
+	    error[t] = current_exception();
+	  }
+	}));
+  for (auto& w: worker)
+    w.join();
+  rethrowFirst (error);
+  for (const auto& p: part)
+    total.merge (p);
+}
+
+void analyzeJournal (const string& filename, int threads, long period, FrameAnalysis& total, string& sequence) {
+  JournalReader reader (filename);
+  Board board = reader.initial;
+  sequence = board.sequence();
+
+  struct Sample { Board board; long move; };
+  const size_t maxQueued = 2 * threads;
+  deque<Sample> queue;
+  vguard<Board> spare;
+  mutex mx;
+  condition_variable ready, taken;
+  bool done = false, failed = false;  // failed: a worker has thrown, so the producer should stop
+
+  vguard<FrameAnalysis> part (threads, total);
+  vguard<exception_ptr> error (threads + 1);  // the last is the producer's
+  vguard<thread> worker;
+  for (int t = 0; t < threads; ++t)
+    worker.push_back (thread ([&, t] {
+	  try {
+	    while (true) {
+	      Sample s;
+	      {
+		unique_lock<mutex> lock (mx);
+		ready.wait (lock, [&] { return !queue.empty() || done; });
+		if (queue.empty())
+		  return;
+		s = move (queue.front());
+		queue.pop_front();
+	      }
+	      taken.notify_one();
+	      part[t].add (s.board, s.move);
+	      lock_guard<mutex> lock (mx);
+	      spare.push_back (move (s.board));
+	    }
+	  } catch (...) {
+	    error[t] = current_exception();
+	    {
+	      lock_guard<mutex> lock (mx);
+	      failed = true;
+	    }
+	    taken.notify_all();
+	  }
+	}));
+
+  // events are numbered from 0, so the state after move m has made m+1 moves, and is labelled m+1 (as trajectory frames are)
+  try {
+    for (long m = reader.firstMove + period - 1; ; m += period) {
+      reader.replayTo (board, m);
+      if (reader.finished() && m >= reader.endMove)
+	break;
+      Sample s;
+      {
+	unique_lock<mutex> lock (mx);
+	taken.wait (lock, [&] { return queue.size() < maxQueued || failed; });
+	if (failed)
+	  break;
+	if (!spare.empty()) {
+	  s.board = move (spare.back());
+	  spare.pop_back();
+	}
+      }
+      s.board.copyStateFrom (board);
+      s.move = m + 1;
+      {
+	lock_guard<mutex> lock (mx);
+	queue.push_back (move (s));
+      }
+      ready.notify_one();
+    }
+  } catch (...) {
+    error[threads] = current_exception();
+  }
+  {
+    lock_guard<mutex> lock (mx);
+    done = true;
+  }
+  ready.notify_all();
+  for (auto& w: worker)
+    w.join();
+  rethrowFirst (error);
+  for (const auto& p: part)
+    total.merge (p);
+}
@@ -0,0 +1,33 @@
+#ifndef ANALYSIS_INCLUDED
+#define ANALYSIS_INCLUDED
+
+#include "cell.h"
+
+// Offline analysis of recorded runs (trajectory & journal files), as done by carnaval-analyze.
+// Samples are labelled by the number of moves made, so a trajectory and a journal of the same run
+// (sampled with the same period) give the same results.
+
+// Statistics over a set of frames; each thread fills its own, and they are merged at the end
+struct FrameAnalysis {
+  bool pairs, strands, folds, series;
+  long frames;
+  map<Board::IndexPair,double> pairCount;
+  map<string,long> strandCount, foldCount;
+  map<long,vguard<double> > energyRg;  // move -> (energy, radius of gyration)
+  FrameAnalysis (bool p = true, bool s = true, bool f = true, bool e = true)
+    : pairs(p), strands(s), folds(f), series(e), frames(0)
+  { }
+
+  static bool isLinear (const Board& board);
+  void add (const Board& board, long move);
+  void merge (const FrameAnalysis& a);
+  json report (const string& sequence) const;
+};
+
+// Trajectories are split into contiguous frame ranges, each decoded by its own reader; stride selects every Nth frame
+void analyzeTrajectory (const string& filename, int threads, long stride, FrameAnalysis& total, string& sequence);
+
+// Journals must be replayed in order, so one thread replays and samples (after every period moves), and the others analyze the samples
+void analyzeJournal (const string& filename, int threads, long period, FrameAnalysis& total, string& sequence);
+
+#endif /* ANALYSIS_INCLUDED */
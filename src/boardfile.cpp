@@ -0,0 +1,366 @@
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "boardfile.h"
+#include "profile.h"
+
+static_assert (sizeof(int) == sizeof(int32_t), "cellStorage is written as 32-bit ints");
+
+const char BoardFileHeader::magicString[] = "CARNAVAL";
+
+MappedFile::MappedFile (const string& filename) : data(NULL), size(0), fd(-1) {
+  fd = open (filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error (string ("Can't open ") + filename);
+  struct stat st;
+  if (fstat (fd, &st) < 0)
+    throw runtime_error (string ("Can't stat ") + filename);
+  size = st.st_size;
+  if (size) {
+    void* p = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+      throw runtime_error (string ("Can't mmap ") + filename);
+    madvise (p, size, MADV_SEQUENTIAL);
+    data = (const char*) p;
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (data)
+    munmap ((void*) data, size);
+  if (fd >= 0)
+    close (fd);
+}
+
+PackedUnit packUnit (const Unit& u) {
+  PackedUnit p;
+  memset (&p, 0, sizeof(p));
+  p.x = u.pos.x();
+  p.y = u.pos.y();
+  p.z = u.pos.z();
+  p.prev = u.prev;
+  p.next = u.next;
+  p.base = u.base;
+  p.rev = u.rev;
+  return p;
+}
+
+Unit unpackUnit (const PackedUnit& p, int index, size_t units) {
+  if (p.base >= Unit::alphabet.size())
+    throw runtime_error ("Binary board has a bad base");
+  if (p.prev < -1 || p.next < -1 || p.prev >= (int64_t) units || p.next >= (int64_t) units)
+    throw runtime_error ("Binary board has a bad chain link");
+  Unit u;
+  u.base = p.base;
+  u.pos = Vec (p.x, p.y, p.z);
+  u.rev = p.rev;
+  u.index = index;
+  u.prev = p.prev;
+  u.next = p.next;
+  return u;
+}
+
+bool isBinaryBoardFile (const string& filename) {
+  ifstream in (filename, ios::binary);
+  char magic[8];
+  return in.read (magic, sizeof(magic)) && memcmp (magic, BoardFileHeader::magicString, sizeof(magic)) == 0;
+}
+
+Board loadBinaryBoard (const string& filename) {
+  MappedFile file (filename);
+  return readBinaryBoard (file.data, file.size);
+}
+
+Board readBinaryBoard (const char* data, size_t size) {
+  BoardFileHeader h;
+  if (size < sizeof(h))
+    throw runtime_error ("Binary board file is truncated");
+  memcpy (&h, data, sizeof(h));
+  if (memcmp (h.magic, BoardFileHeader::magicString, sizeof(h.magic)) != 0)
+    throw runtime_error ("Not a binary board file");
+  if (h.byteOrder != BoardFileHeader::byteOrderMark)
+    throw runtime_error ("Binary board file has the wrong byte order for this machine");
+  if (h.version > BoardFileHeader::currentVersion || h.headerSize < sizeof(h))
+    throw runtime_error ("Unsupported binary board file version");
+
+  // sizes are checked before use, so a corrupt header can't make us allocate wildly or read past the end of the data
+  if (h.xSize <= 0 || h.ySize <= 0 || h.zSize <= 0
+      || (uint64_t) h.xSize * h.ySize * h.zSize > (uint64_t) numeric_limits<int>::max() / 2)
+    throw runtime_error ("Binary board file has bad board dimensions");
+  if (h.units > (uint64_t) numeric_limits<int>::max())
+    throw runtime_error ("Binary board file has too many units");
+  const uint64_t cells = 2 * (uint64_t) h.xSize * h.ySize * h.zSize;
+  const uint64_t dataBytes = h.units * sizeof(PackedUnit) + ((h.flags & BoardFileHeader::HasCells) ? cells * sizeof(int32_t) : 0);
+  if (size < h.headerSize || size - h.headerSize < dataBytes)
+    throw runtime_error ("Binary board file is truncated");
+
+  Board board (h.xSize, h.ySize, h.zSize);
+  board.params.splitProb = h.splitProb;
+  board.params.stackEnergy = h.stackEnergy;
+  board.params.auEnergy = h.auEnergy;
+  board.params.gcEnergy = h.gcEnergy;
+  board.params.guEnergy = h.guEnergy;
+  board.params.temp = h.temp;
+  board.params.bondProb = h.bondProb;
+
+  const size_t cellBytes = (h.flags & BoardFileHeader::HasCells) ? cells * sizeof(int32_t) : 0;
+  const PackedUnit* pu = (const PackedUnit*) (data + h.headerSize);
+  board.unit.resize (h.units);
+  for (size_t n = 0; n < h.units; ++n)
+    board.unit[n] = unpackUnit (pu[n], n, h.units);
+  if (cellBytes)
+    memcpy (board.cellStorage.data(), pu + h.units, cellBytes);
+  else
+    for (const Unit& u: board.unit)
+      board.cell (u.pos, u.rev) = u.index;
+
+  board.assertValid();
+  board.unwrapChains();
+  board.initPositionSums();
+  board.touch();
+  return board;
+}
+
+void saveBinaryBoard (const Board& board, const string& filename, bool withCells) {
+  ofstream out (filename, ios::binary);
+  if (!out)
+    throw runtime_error (string ("Can't write ") + filename);
+  writeBinaryBoard (board, out, withCells);
+  out.close();
+  if (!out)
+    throw runtime_error (string ("Error writing ") + filename);
+}
+
+size_t binaryBoardSize (const Board& board, bool withCells) {
+  return sizeof(BoardFileHeader) + board.unit.size() * sizeof(PackedUnit) + (withCells ? board.cellStorage.size() * sizeof(int32_t) : 0);
+}
+
+void writeBinaryBoard (const Board& board, ostream& out, bool withCells) {
+  BoardFileHeader h;
+  memset (&h, 0, sizeof(h));
+  memcpy (h.magic, BoardFileHeader::magicString, sizeof(h.magic));
+  h.version = BoardFileHeader::currentVersion;
+  h.byteOrder = BoardFileHeader::byteOrderMark;
+  h.flags = withCells ? BoardFileHeader::HasCells : 0;
+  h.headerSize = sizeof(h);
+  h.xSize = board.xSize;
+  h.ySize = board.ySize;
+  h.zSize = board.zSize;
+  h.units = board.unit.size();
+  h.splitProb = board.params.splitProb;
+  h.stackEnergy = board.params.stackEnergy;
+  h.auEnergy = board.params.auEnergy;
+  h.gcEnergy = board.params.gcEnergy;
+  h.guEnergy = board.params.guEnergy;
+  h.temp = board.params.temp;
+  h.bondProb = board.params.bondProb;
+  out.write ((const char*) &h, sizeof(h));
+
+  // units are packed in chunks, to bound memory
+  const size_t chunkSize = 1 << 16;
+  vguard<PackedUnit> chunk;
+  chunk.reserve (chunkSize);
+  for (size_t start = 0; start < board.unit.size(); start += chunkSize) {
+    chunk.clear();
+    for (size_t n = start; n < board.unit.size() && n < start + chunkSize; ++n)
+      chunk.push_back (packUnit (board.unit[n]));
+    out.write ((const char*) chunk.data(), chunk.size() * sizeof(PackedUnit));
+  }
+
+  if (withCells)
+    out.write ((const char*) board.cellStorage.data(), board.cellStorage.size() * sizeof(int32_t));
+}
+
+// SAX handler for board JSON; unknown keys are skipped.
+// Integers that would be truncated on the way into an int are rejected here, before they can alias a valid value
+class BoardJsonReader : public nlohmann::json_sax<json> {
+public:
+  int size[3], sizeCount, posCount;
+  Params params;
+  vguard<Unit> unit;
+  vguard<int> next;  // each Unit's "next", or -2 if it has none; readJsonBoard rebuilds next from prev, & checks it against this
+
+  BoardJsonReader() : sizeCount(0), posCount(0) { size[0] = size[1] = size[2] = 0; }
+
+  bool null() { return true; }
+  bool boolean (bool val) {
+    if (context() == UnitObject && currentKey == "rev")
+      current.rev = val;
+    return true;
+  }
+  bool number_integer (number_integer_t val) { return number ((double) val, val); }
+  bool number_unsigned (number_unsigned_t val) { return number ((double) val, val); }
+  bool number_float (number_float_t val, const string_t&) { return number (val, abs (val) < 1e18 ? (long long) val : 0); }
+  bool string (string_t& val) {
+    if (context() == UnitObject && currentKey == "base") {
+      if (val.empty())
+	throw runtime_error ("Empty base");
+      current.base = Unit::char2base (val[0]);
+    }
+    return true;
+  }
+  bool start_object (std::size_t) {
+    Context c = Other;
+    if (stack.empty())
+      c = Top;
+    else if (context() == Top && currentKey == "params")
+      c = ParamsObject;
+    else if (context() == Units) {
+      c = UnitObject;
+      current = Unit (0, 0, 0, 0, false, unit.size(), -1, -1);
+      currentNext = -2;
+      posCount = 0;
+    }
+    stack.push_back (c);
+    return true;
+  }
+  bool key (string_t& val) {
+    currentKey = val;
+    return true;
+  }
+  bool end_object() {
+    if (context() == UnitObject) {
+      if (posCount != 3)
+	throw runtime_error ("Board JSON Unit has no position");
+      unit.push_back (current);
+      next.push_back (currentNext);
+    }
+    stack.pop_back();
+    return true;
+  }
+  bool start_array (std::size_t) {
+    Context c = Other;
+    if (context() == Top && currentKey == "size")
+      c = Size;
+    else if (context() == Top && currentKey == "unit")
+      c = Units;
+    else if (context() == UnitObject && currentKey == "pos")
+      c = Pos;
+    stack.push_back (c);
+    return true;
+  }
+  bool end_array() {
+    stack.pop_back();
+    return true;
+  }
+  bool parse_error (std::size_t, const std::string&, const nlohmann::detail::exception& ex) {
+    throw runtime_error (std::string ("Error parsing board JSON: ") + ex.what());
+  }
+
+private:
+  enum Context { Top, ParamsObject, Size, Units, UnitObject, Pos, Other };
+  vector<Context> stack;
+  std::string currentKey;
+  Unit current;
+  int currentNext;
+
+  inline Context context() const { return stack.empty() ? Other : stack.back(); }
+  static inline bool isInt (double val, long long ival) {
+    return val == (double) ival && ival >= numeric_limits<int>::min() && ival <= numeric_limits<int>::max();
+  }
+  bool number (double val, long long ival) {
+    switch (context()) {
+    case ParamsObject:
+      if (currentKey == "split") params.splitProb = val;
+      else if (currentKey == "stack") params.stackEnergy = val;
+      else if (currentKey == "au") params.auEnergy = val;
+      else if (currentKey == "gc") params.gcEnergy = val;
+      else if (currentKey == "gu") params.guEnergy = val;
+      else if (currentKey == "temp") params.temp = val;
+      else if (currentKey == "bond") params.bondProb = val;
+      break;
+    case Size:
+      if (!isInt (val, ival) || ival <= 0)
+	throw runtime_error ("Board JSON has bad board dimensions");
+      if (sizeCount < 3)
+	size[sizeCount++] = ival;
+      break;
+    case Pos:
+      if (!isInt (val, ival))
+	throw runtime_error ("Board JSON Unit position is out of range");
+      if (posCount < 3)
+	current.pos.xyz[posCount++] = ival;
+      break;
+    case UnitObject:
+      if ((currentKey == "prev" || currentKey == "next") && (!isInt (val, ival) || ival < -1))
+	throw runtime_error ("Board JSON has a bad chain link");
+      if (currentKey == "prev")
+	current.prev = ival;
+      else if (currentKey == "next")
+	currentNext = ival;
+      break;
+    default:
+      break;
+    }
+    return true;
+  }
+};
+
+Board readJsonBoard (istream& in) {
+  PhaseTimer timer (Profiler::Json);
+  BoardJsonReader reader;
+  json::sax_parse (in, &reader);
+  if (reader.sizeCount != 3)
+    throw runtime_error ("Board JSON has no size");
+  // the same limits as binary boards, so that every cell index fits in an int
+  if ((uint64_t) reader.size[0] * reader.size[1] * reader.size[2] > (uint64_t) numeric_limits<int>::max() / 2)
+    throw runtime_error ("Board JSON has bad board dimensions");
+  Board board (reader.size[0], reader.size[1], reader.size[2]);
+  board.params = reader.params;
+  board.unit.swap (reader.unit);
+  const int units = board.unit.size();
+  for (Unit& u: board.unit) {
+    if (u.prev >= units || u.prev == u.index || reader.next[u.index] >= units)
+      throw runtime_error ("Board JSON has a bad chain link");
+    if (board.cell (u.pos, u.rev) >= 0)
+      throw runtime_error ("Board JSON has two Units in one cell");
+    board.cell (u.pos, u.rev) = u.index;
+    if (u.prev >= 0) {
+      if (board.unit[u.prev].next >= 0)
+	throw runtime_error ("Board JSON has two Units with the same prev");
+      board.unit[u.prev].next = u.index;
+    }
+  }
+  // next is optional, but must agree with prev where it's given
+  for (const Unit& u: board.unit)
+    if (reader.next[u.index] != -2 && reader.next[u.index] != u.next)
+      throw runtime_error ("Board JSON has inconsistent Unit.next & Unit.prev");
+  board.assertValid();
+  board.unwrapChains();
+  board.initPositionSums();
+  board.touch();
+  return board;
+}
+
+void writeJsonBoard (const Board& board, ostream& out) {
+  PhaseTimer timer (Profiler::Json);
+  board.assertValid();
+  // keys in the order nlohmann::json sorts them
+  out << "{\"params\":" << board.params.toJson()
+      << ",\"size\":[" << board.xSize << ',' << board.ySize << ',' << board.zSize << ']';
+  if (board.unit.size()) {
+    out << ",\"unit\":[";
+    for (size_t n = 0; n < board.unit.size(); ++n) {
+      const Unit& u = board.unit[n];
+      if (n)
+	out << ',';
+      out << "{\"base\":\"" << u.baseChar() << '"';
+      if (u.next >= 0)
+	out << ",\"next\":" << u.next;
+      out << ",\"pos\":[" << u.pos.x() << ',' << u.pos.y() << ',' << u.pos.z() << ']';
+      if (u.prev >= 0)
+	out << ",\"prev\":" << u.prev;
+      if (u.rev)
+	out << ",\"rev\":true";
+      out << '}';
+    }
+    out << ']';
+  }
+  out << '}';
+}
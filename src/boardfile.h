@@ -0,0 +1,60 @@
+#ifndef BOARDFILE_INCLUDED
+#define BOARDFILE_INCLUDED
+
+#include <cstdint>
+#include "cell.h"
+
+// Binary board files.
+// Layout (native byte order, checked on load):
+//   BoardFileHeader
+//   PackedUnit[units]
+//   int32_t[2*xSize*ySize*zSize] cellStorage, if flags & HasCells (otherwise rebuilt from the units)
+// Files are read through mmap, and copied straight into the Board's arrays without parsing.
+// JSON remains the interchange format; binary is for big boards and checkpoints.
+
+struct BoardFileHeader {
+  char magic[8];  // "CARNAVAL"
+  uint32_t version, byteOrder, flags, headerSize;
+  int32_t xSize, ySize, zSize, reserved;
+  uint64_t units;
+  double splitProb, stackEnergy, auEnergy, gcEnergy, guEnergy, temp, bondProb;
+  enum { HasCells = 1 };
+  static const char magicString[];
+  static const uint32_t currentVersion = 1, byteOrderMark = 0x01020304;
+};
+
+struct PackedUnit {
+  int32_t x, y, z, prev, next;
+  uint8_t base, rev, reserved[2];
+};
+
+PackedUnit packUnit (const Unit&);
+Unit unpackUnit (const PackedUnit&, int index, size_t units);  // checks the base & chain links against the number of Units
+
+// read-only mapping of a whole file
+class MappedFile {
+public:
+  const char* data;
+  size_t size;
+  MappedFile (const string& filename);
+  ~MappedFile();
+private:
+  int fd;
+  MappedFile (const MappedFile&) = delete;
+  MappedFile& operator= (const MappedFile&) = delete;
+};
+
+bool isBinaryBoardFile (const string& filename);  // true if the file starts with the binary board magic
+Board loadBinaryBoard (const string& filename);
+void saveBinaryBoard (const Board& board, const string& filename, bool withCells = true);
+Board readBinaryBoard (const char* data, size_t size);  // from memory, e.g. a mapped file
+void writeBinaryBoard (const Board& board, ostream& out, bool withCells = true);
+size_t binaryBoardSize (const Board& board, bool withCells = true);  // bytes written by writeBinaryBoard
+
+// Streaming JSON board files, in the schema of Board::toJson/fromJson, without building a document.
+// The reader parses units one at a time (SAX) straight into the Board's unit array;
+// the writer emits units one at a time, byte-for-byte as Board::toJson() would be dumped.
+Board readJsonBoard (istream& in);
+void writeJsonBoard (const Board& board, ostream& out);
+
+#endif /* BOARDFILE_INCLUDED */
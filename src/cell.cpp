@@ -1,6 +1,7 @@
-#include <set>
 #include <algorithm>
 #include "cell.h"
+#include "profile.h"
+#include "journal.h"  // for MoveJournal instantiations
 
 Params Params::fromJson (json& j) {
   Params p;
@@ -28,20 +29,28 @@ json Params::toJson() const {
 
 string Unit::alphabet ("acgu");
 
-Board::Board() : dist(0,1), baseDist(0,3)
-{ }
+Board::Board() : xSize(0), ySize(0), zSize(0), dist(0,1), baseDist(0,3),
+		 pairVersion(0), chainVersion(0), posVersion(0),
+		 pairListVersion(~0ULL), layoutVersion(~0ULL), coloredFoldVersion(~0ULL), foldEnergyVersion(~0ULL)
+{
+  initPositionSums();
+}
 
 Board::Board (int xs, int ys, int zs)
-  : xSize(xs), ySize(ys), zSize(zs), cellStorage (2*xs*ys*zs, -1), dist(0,1), baseDist(0,3)
+  : xSize(xs), ySize(ys), zSize(zs), cellStorage (2*xs*ys*zs, -1), dist(0,1), baseDist(0,3),
+    pairVersion(0), chainVersion(0), posVersion(0),
+    pairListVersion(~0ULL), layoutVersion(~0ULL), coloredFoldVersion(~0ULL), foldEnergyVersion(~0ULL)
 {
   for (int x = -nbrRange(xs); x <= nbrRange(xs); ++x)
     for (int y = -nbrRange(ys); y <= nbrRange(ys); ++y)
       for (int z = -nbrRange(zs); z <= nbrRange(zs); ++z)
 	if (x != 0 || y != 0 || z != 0)
 	  neighborhood.push_back (Vec (x, y, z));
+  initPositionSums();
 }
 
 Board Board::fromJson (json& j) {
+  PhaseTimer timer (Profiler::Json);
   json& js = j["size"];
   Board board (js[0], js[1], js[2]);
   board.params = Params::fromJson (j["params"]);
@@ -52,7 +61,7 @@ Board Board::fromJson (json& j) {
 	       jp[0].get<int>(),
 	       jp[1].get<int>(),
 	       jp[2].get<int>(),
-	       jp.count("rev") && jp["rev"].get<bool>(),
+	       ju.count("rev") && ju["rev"].get<bool>(),
 	       index,
 	       ju.count("prev") ? ju["prev"].get<int>() : -1,
 	       -1);
@@ -63,10 +72,14 @@ Board Board::fromJson (json& j) {
     if (u.prev >= 0)
       board.unit[u.prev].next = u.index;
   board.assertValid();
+  board.unwrapChains();
+  board.initPositionSums();
+  board.touch();
   return board;
 }
 
 json Board::toJson() const {
+  PhaseTimer timer (Profiler::Json);
   assertValid();
   json j;
   j["size"] = { xSize, ySize, zSize };
@@ -86,6 +99,70 @@ json Board::toJson() const {
   return j;
 }
 
+const char* MoveStats::outcomeName[] = { "outOfReach", "splitAccepted", "splitRejected", "splitMergeAccepted", "splitMergeRejected", "splitBlocked", "pairedAccepted", "pairedBlocked", "ligationAccepted", "freeAccepted", "mergeAccepted", "mergeRejected", "freeBlocked" };
+
+json MoveStats::toJson (double wallSeconds) const {
+  json j;
+  j["tried"] = tried;
+  j["accepted"] = accepted;
+  j["seconds"] = seconds;
+  j["wallSeconds"] = wallSeconds;
+  if (seconds > 0) {
+    j["movesPerSecond"] = tried / seconds;
+    j["acceptedPerSecond"] = accepted / seconds;
+  }
+  long counted = 0;
+  for (int o = 0; o < MoveOutcomes; ++o)
+    counted += outcome[o];
+  if (counted) {
+    for (int o = 0; o < MoveOutcomes; ++o)
+      j["outcomes"][outcomeName[o]] = outcome[o];
+    // attempts & acceptance ratio per class of move; rejected attempts are Metropolis rejections, blocked ones were never proposed
+    auto addClass = [&] (const char* name, long acc, long rej, long blocked) {
+      json jc;
+      jc["accepted"] = acc;
+      jc["rejected"] = rej;
+      jc["blocked"] = blocked;
+      const long attempts = acc + rej + blocked;
+      if (attempts)
+	jc["acceptance"] = ((double) acc) / attempts;
+      j["classes"][name] = jc;
+    };
+    // a split attempt is blocked if the target is occupied by something it can't pair with
+    addClass ("split", outcome[SplitAccepted], outcome[SplitRejected], outcome[SplitBlocked]);
+    addClass ("splitMerge", outcome[SplitMergeAccepted], outcome[SplitMergeRejected], 0);
+    addClass ("paired", outcome[PairedAccepted], 0, outcome[PairedBlocked]);
+    addClass ("ligation", outcome[LigationAccepted], 0, 0);
+    addClass ("free", outcome[FreeAccepted], 0, outcome[FreeBlocked]);
+    addClass ("merge", outcome[MergeAccepted], outcome[MergeRejected], 0);
+    j["outOfReach"] = outcome[OutOfReach];
+  }
+  return j;
+}
+
+void Board::copyStateFrom (const Board& b, bool copyCells) {
+  xSize = b.xSize;
+  ySize = b.ySize;
+  zSize = b.zSize;
+  params = b.params;
+  if (neighborhood.size() != b.neighborhood.size())
+    neighborhood = b.neighborhood;
+  unit = b.unit;
+  if (copyCells)
+    cellStorage = b.cellStorage;
+  else
+    cellStorage.clear();
+  posOrigin = b.posOrigin;
+  for (size_t n = 0; n < 3; ++n) {
+    posSum[n] = b.posSum[n];
+    posSqSum[n] = b.posSqSum[n];
+  }
+  // versions only ever increase, so caches computed for an earlier snapshot of the same Board stay valid if they match
+  pairVersion = b.pairVersion;
+  chainVersion = b.chainVersion;
+  posVersion = b.posVersion;
+}
+
 void Board::addSeq (const string& seq) {
   if (xSize < seq.length())
     throw runtime_error ("Board is too small for sequence");
@@ -109,6 +186,8 @@ void Board::addSeq (const string& seq) {
     unit.push_back (u);
     cell (u.pos, false) = index;
   }
+  initPositionSums();
+  touch();
 }
 
 void Board::addBases (double density, mt19937& mt) {
@@ -130,47 +209,169 @@ void Board::addBases (double density, mt19937& mt) {
 	  unit.push_back (u);
 	  cell (u.pos, false) = index;
 	}
+  initPositionSums();
+  touch();
 }
 
 const Vec& Board::rndNbrVec (mt19937& mt) const {
   return neighborhood [mt() % neighborhood.size()];
 }
 
+void Board::unwrapChains() {
+  vguard<bool> seen (unit.size());
+  for (int pass = 0; pass < 2; ++pass)  // linear chains first, then any cyclic ones
+    for (const Unit& head: unit)
+      if (!seen[head.index] && (pass > 0 || head.prev < 0)) {
+	seen[head.index] = true;
+	for (int i = head.next; i >= 0 && !seen[i]; i = unit[i].next) {
+	  Unit& u = unit[i];
+	  const Vec& prevPos = unit[u.prev].pos;
+	  u.pos = prevPos + minimumImage (u.pos - prevPos);
+	  seen[i] = true;
+	}
+      }
+}
+
+void Board::trackDirtyUnits (bool track) {
+  unitBrickDirty.clear();
+  if (track)
+    unitBrickDirty.resize ((unit.size() >> unitBrickShift) + 1, 0);
+}
+
+void Board::clearDirtyUnits() {
+  fill (unitBrickDirty.begin(), unitBrickDirty.end(), 0);
+}
+
+void Board::unwrapFrom (int index) {
+  const Vec& pos = unit[index].pos;
+  const int next = unit[index].next;
+  if (next < 0)
+    return;
+  const Vec diff = unit[next].pos - pos;
+  const Vec shift = minimumImage (diff) - diff;
+  if (shift.isZero())
+    return;
+  for (int i = next; i >= 0 && i != index; i = unit[i].next) {
+    Unit& u = unit[i];
+    for (size_t n = 0; n < 3; ++n) {
+      posSum[n] += shift.xyz[n];
+      posSqSum[n] += (long long) shift.xyz[n] * (2 * (u.pos.xyz[n] - posOrigin.xyz[n]) + shift.xyz[n]);
+    }
+    u.pos = u.pos + shift;
+  }
+  ++posVersion;
+}
+
+void Board::initPositionSums() const {
+  vguard<double> c (3);
+  for (auto& u: unit)
+    for (size_t n = 0; n < 3; ++n)
+      c[n] += u.pos.xyz[n];
+  for (size_t n = 0; n < 3; ++n) {
+    posOrigin.xyz[n] = unit.size() ? (int) round (c[n] / unit.size()) : 0;
+    posSum[n] = posSqSum[n] = 0;
+  }
+  for (auto& u: unit)
+    for (size_t n = 0; n < 3; ++n) {
+      const long long q = u.pos.xyz[n] - posOrigin.xyz[n];
+      posSum[n] += q;
+      posSqSum[n] += q * q;
+    }
+}
+
 void Board::assertValid() const {
-  set<int> seen;
+  PhaseTimer timer (Profiler::Validation);
+  vector<bool> seen (unit.size());
+  size_t nSeen = 0;
   for (int x = 0; x < xSize; ++x)
     for (int y = 0; y < ySize; ++y)
-      for (int z = 0; z < zSize; ++z)
+      for (int z = 0; z < zSize; ++z) {
+	const Vec pos (x, y, z);
+	assertValidCell (pos);
 	for (int rev = 0; rev <= 1; rev++) {
 	  const int idx = cell (x, y, z, rev);
 	  if (idx >= 0) {
-	    if (seen.count(idx))
+	    if (seen[idx])
 	      throw runtime_error ("Duplicate Unit index");
-	    const Unit u = unit[idx];
-	    if (u.index != idx)
-	      throw runtime_error ("Incorrect Unit index");
-	    if (!boardCoordsEqual (Vec(x,y,z), u.pos) || (rev ? !u.rev : u.rev))
-	      throw runtime_error ("Mislocated Unit");
-	    if (u.prev >= 0 && unit[u.prev].next != idx)
-	      throw runtime_error ("Broken Unit.prev");
-	    if (u.next >= 0 && unit[u.next].prev != idx)
-	      throw runtime_error ("Broken Unit.next");
-	    if (rev && cell (x, y, z, false) < 0)
-	      throw runtime_error ("Unit.rev is true but no paired Unit exists");
-	    seen.insert (idx);
+	    seen[idx] = true;
+	    ++nSeen;
 	  }
 	}
-  if (seen.size() != unit.size())
+      }
+  if (nSeen != unit.size())
     throw runtime_error ("Missing Unit");
+  for (size_t idx = 0; idx < unit.size(); ++idx)
+    assertValidUnit (idx);
+}
+
+void Board::assertValidCell (const Vec& pos) const {
+  for (int rev = 0; rev <= 1; rev++) {
+    const int idx = cell (pos, rev);
+    if (idx >= 0) {
+      if (idx >= (int) unit.size())
+	throw runtime_error ("Incorrect Unit index");
+      const Unit& u = unit[idx];
+      if (!boardCoordsEqual (pos, u.pos) || (rev ? !u.rev : u.rev))
+	throw runtime_error ("Mislocated Unit");
+      if (rev && cell (pos, false) < 0)
+	throw runtime_error ("Unit.rev is true but no paired Unit exists");
+    }
+  }
+}
+
+void Board::assertValidUnit (int idx) const {
+  if (idx < 0 || idx >= (int) unit.size())
+    throw runtime_error ("Incorrect Unit index");
+  const Unit& u = unit[idx];
+  if (u.index != idx)
+    throw runtime_error ("Incorrect Unit index");
+  if (cell (u.pos, u.rev) != idx)
+    throw runtime_error ("Mislocated Unit");
+  if (u.prev >= 0 && (u.prev >= (int) unit.size() || unit[u.prev].next != idx))
+    throw runtime_error ("Broken Unit.prev");
+  if (u.next >= 0 && (u.next >= (int) unit.size() || unit[u.next].prev != idx))
+    throw runtime_error ("Broken Unit.next");
+  if ((u.prev >= 0 && !adjacent (u.pos, unit[u.prev].pos)) || (u.next >= 0 && !adjacent (u.pos, unit[u.next].pos)))
+    throw runtime_error ("Chain is broken");
+  const int p = pairedIndex (u);
+  if (p >= 0) {
+    const Unit& v = unit[p];
+    if (!u.isComplementOrWobble (v) || u.next == p || u.prev == p)
+      throw runtime_error ("Illegal basepair");
+  }
+}
+
+void Board::assertValidLocal (const Vec& oldPos, int i, int j, int k) const {
+  assertValidCell (oldPos);
+  for (int idx: { i, j, k })
+    if (idx >= 0) {
+      const Unit& u = unit[idx];
+      assertValidCell (u.pos);
+      assertValidUnit (idx);
+      for (int nbr: { u.prev, u.next, pairedIndex (u) })
+	if (nbr >= 0)
+	  assertValidUnit (nbr);
+    }
 }
 
 bool Board::tryMove (mt19937& mt) {
+  NullMoveEvents events;
+  return tryMove (mt, events);
+}
+
+template<class Events>
+bool Board::tryMove (mt19937& mt, Events& events) {
   bool moved = false;
   if (unit.size()) {
     const int index = mt() % unit.size();
     Unit& u = unit[index];
     const Vec& delta = rndNbrVec (mt);
+    const int dir = &delta - neighborhood.data();
     const Vec newPos = u.pos + delta;
+#ifdef DEBUG
+    const Vec oldPos = u.pos;
+    const int oldPair = pairedIndex (u);
+#endif
     //    cerr << "Attempting to move unit #" << index << " from " << u.pos << " to " << newPos << endl;
     if (canMoveTo (u, newPos)) {
       const int nbrIndex = cell (newPos, false);
@@ -188,8 +389,13 @@ bool Board::tryMove (mt19937& mt) {
 	      moveUnit (u, newPos, false);
 	      moveUnit (p, p.pos, false);
 	      //	    cerr << "Paired unit is now at " << p.pos << "." << p.rev << endl;
+	      ++pairVersion;
+	      events.unpaired (index, p.index);
+	      events.moved (index, dir, SplitMove);
+	      events.outcome (SplitAccepted);
 	      moved = true;
-	    }
+	    } else
+	      events.outcome (SplitRejected);
 	  } else {
 	    Unit& nbr = unit[nbrIndex];
 	    if (nbrPairIndex < 0 && canMerge (u, nbr)) {
@@ -198,9 +404,16 @@ bool Board::tryMove (mt19937& mt) {
 		moveUnit (u, newPos, true);
 		moveUnit (p, p.pos, false);
 		//	      cerr << "Paired unit is now at " << p.pos << "." << p.rev << endl;
+		++pairVersion;
+		events.unpaired (index, p.index);
+		events.paired (index, nbrIndex);
+		events.moved (index, dir, SplitMergeMove);
+		events.outcome (SplitMergeAccepted);
 		moved = true;
-	      }
-	    }
+	      } else
+		events.outcome (SplitMergeRejected);
+	    } else
+	      events.outcome (SplitBlocked);
 	  }
 	} else {  // paired and not attempting split
 	  if (nbrIndex < 0 && nbrPairIndex < 0 && canMoveTo (p, newPos)) {
@@ -208,6 +421,8 @@ bool Board::tryMove (mt19937& mt) {
 	    moveUnit (u, newPos, u.rev);
 	    moveUnit (p, newPos, p.rev);
 	    //	    cerr << "Paired unit is now at " << p.pos << "." << p.rev << endl;
+	    events.moved (index, dir, PairedMove);
+	    events.outcome (PairedAccepted);
 	    moved = true;
 	  } else if (nbrIndex >= 0 && nbrPairIndex >= 0 && u.next < 0) {
 	    Unit& nbr = unit[nbrIndex];
@@ -215,18 +430,32 @@ bool Board::tryMove (mt19937& mt) {
 	    if (p.prev == nbrIndex && nbrp.prev < 0) {
 	      nbrp.prev = index;
 	      u.next = nbrPairIndex;
+	      unwrapFrom (index);
+	      ++chainVersion;
+	      events.ligated (index, nbrPairIndex);
+	      events.moved (index, dir, LigationMove);
+	      events.outcome (LigationAccepted);
 	      moved = true;
 	    } else if (p.prev == nbrPairIndex && nbr.prev < 0) {
 	      nbr.prev = index;
 	      u.next = nbrIndex;
+	      unwrapFrom (index);
+	      ++chainVersion;
+	      events.ligated (index, nbrIndex);
+	      events.moved (index, dir, LigationMove);
+	      events.outcome (LigationAccepted);
 	      moved = true;
-	    }
-	  }
+	    } else
+	      events.outcome (PairedBlocked);
+	  } else
+	    events.outcome (PairedBlocked);
 	}
       } else {  // not paired
 	if (nbrIndex < 0) {
 	  // move to forward slot
 	  moveUnit (u, newPos, false);
+	  events.moved (index, dir, FreeMove);
+	  events.outcome (FreeAccepted);
 	  moved = true;
 	} else {
 	  Unit& nbr = unit[nbrIndex];
@@ -234,17 +463,115 @@ bool Board::tryMove (mt19937& mt) {
 	    if (acceptMove (pairingEnergy(u,nbr), 1. / params.splitProb, mt)) {
 	      // move to rev slot
 	      moveUnit (u, newPos, true);
+	      ++pairVersion;
+	      events.paired (index, nbrIndex);
+	      events.moved (index, dir, MergeMove);
+	      events.outcome (MergeAccepted);
 	      moved = true;
-	    }
-	  }
+	    } else
+	      events.outcome (MergeRejected);
+	  } else
+	    events.outcome (FreeBlocked);
 	}
       }
-    }
+    } else
+      events.outcome (OutOfReach);
+#ifdef DEBUG
+    if (moved)
+      assertValidLocal (oldPos, index, oldPair);
+#endif
   }
-  //  assertValid();
   return moved;
 }
 
+template bool Board::tryMove<NullMoveEvents> (mt19937&, NullMoveEvents&);
+template bool Board::tryMove<MoveCounter> (mt19937&, MoveCounter&);
+template bool Board::tryMove<MoveEventLog> (mt19937&, MoveEventLog&);
+template bool Board::tryMove<DirtyUnitTracker> (mt19937&, DirtyUnitTracker&);
+template bool Board::tryMove<MoveJournal> (mt19937&, MoveJournal&);
+
+template<class Events>
+void Board::replayMove (int index, int dir, MoveType type, Events& events) {
+  if (index < 0 || index >= (int) unit.size() || dir < 0 || dir >= (int) neighborhood.size())
+    throw runtime_error ("Replayed move is out of range");
+  Unit& u = unit[index];
+  const Vec newPos = u.pos + neighborhood[dir];
+  const int nbrIndex = cell (newPos, false);
+  const int nbrPairIndex = cell (newPos, true);
+  const int pairIndex = pairedIndex (u);
+  switch (type) {
+  case FreeMove:
+    moveUnit (u, newPos, false);
+    break;
+  case MergeMove:
+    if (nbrIndex < 0)
+      throw runtime_error ("Replayed merge has no partner");
+    moveUnit (u, newPos, true);
+    ++pairVersion;
+    events.paired (index, nbrIndex);
+    break;
+  case SplitMove:
+  case SplitMergeMove:
+    if (pairIndex < 0)
+      throw runtime_error ("Replayed split of an unpaired unit");
+    moveUnit (u, newPos, type == SplitMergeMove);
+    moveUnit (unit[pairIndex], unit[pairIndex].pos, false);
+    ++pairVersion;
+    events.unpaired (index, pairIndex);
+    if (type == SplitMergeMove)
+      events.paired (index, nbrIndex);
+    break;
+  case PairedMove:
+    if (pairIndex < 0)
+      throw runtime_error ("Replayed paired move of an unpaired unit");
+    moveUnit (u, newPos, u.rev);
+    moveUnit (unit[pairIndex], newPos, unit[pairIndex].rev);
+    break;
+  case LigationMove:
+    {
+      if (pairIndex < 0 || nbrIndex < 0 || nbrPairIndex < 0)
+	throw runtime_error ("Replayed ligation has no template");
+      const int nextIndex = unit[pairIndex].prev == nbrIndex ? nbrPairIndex : nbrIndex;
+      unit[nextIndex].prev = index;
+      u.next = nextIndex;
+      unwrapFrom (index);
+      ++chainVersion;
+      events.ligated (index, nextIndex);
+    }
+    break;
+  default:
+    throw runtime_error ("Unknown move class in replay");
+  }
+  events.moved (index, dir, type);
+}
+
+template void Board::replayMove<NullMoveEvents> (int, int, MoveType, NullMoveEvents&);
+template void Board::replayMove<MoveEventLog> (int, int, MoveType, MoveEventLog&);
+
+void Board::run (long count, mt19937& mt, MoveStats& stats) {
+  NullMoveEvents events;
+  run (count, mt, stats, events);
+}
+
+template<class Events>
+void Board::run (long count, mt19937& mt, MoveStats& stats, Events& events) {
+  long accepted = 0;
+  for (long n = 0; n < count; ++n) {
+    if (tryMove (mt, events))
+      ++accepted;
+    events.nextMove();
+  }
+  stats.tried += count;
+  stats.accepted += accepted;
+  events.addCounts (stats);
+}
+
+template void Board::run<NullMoveEvents> (long, mt19937&, MoveStats&, NullMoveEvents&);
+template void Board::run<MoveCounter> (long, mt19937&, MoveStats&, MoveCounter&);
+template void Board::run<MoveEventLog> (long, mt19937&, MoveStats&, MoveEventLog&);
+template void Board::run<DirtyUnitTracker> (long, mt19937&, MoveStats&, DirtyUnitTracker&);
+template void Board::run<MoveJournal> (long, mt19937&, MoveStats&, MoveJournal&);
+
 void Board::dump (ostream& out) const {
   for (int x = 0; x < xSize; ++x)
     for (int y = 0; y < ySize; ++y)
@@ -261,17 +588,29 @@ void Board::dump (ostream& out) const {
 }
 
 vguard<Board::IndexPair> Board::indexPairs() const {
-  vguard<IndexPair> p;
+  return pairList();
+}
+
+const vguard<Board::IndexPair>& Board::pairList() const {
+  if (pairListVersion != structureVersion()) {
+    indexPairs (pairListCache);
+    pairListVersion = structureVersion();
+  }
+  return pairListCache;
+}
+
+void Board::indexPairs (vguard<IndexPair>& p) const {
+  p.clear();
   for (int i = 0; i < unit.size(); ++i) {
     const Unit& u = unit[i];
     const int j = pairedIndex(u);
     if (j > i)
       p.push_back (IndexPair (i, j));
   }
-  return p;
 }
 
 void Board::assertLinear() const {
+  PhaseTimer timer (Profiler::Validation);
   for (size_t i = 0; i < unit.size(); ++i) {
     const Unit& u = unit[i];
     if (u.index != i || (i > 0 && u.prev != i-1) || (i < unit.size()-1 && u.next != i+1))
@@ -289,62 +628,84 @@ string Board::sequence() const {
 
 string Board::leftFoldChar ("<[{(abcdefghijklmnopqrstuvwxyz");
 string Board::rightFoldChar (">]})ABCDEFGHIJKLMNOPQRSTUVWXYZ");
-string Board::foldString() const {
-  string fs (unit.size(), '.');
-  map<size_t,set<IndexPair>> offsetPairs;
-  for (const auto& ij: indexPairs()) {
+// Pairs are visited in order of their left index, and each goes to the lowest level with no crossing pair.
+// Pairs on one level never cross, so those still open at i (a < i < b) are nested,
+// and the innermost (smallest b) is the only one that can cross (i,j). A stack per level suffices.
+void Board::layoutFold() const {
+  if (layoutVersion == structureVersion())
+    return;
+  layoutVersion = structureVersion();
+  const vguard<IndexPair>& foldPairs = pairList();
+  foldChars.assign (unit.size(), '.');
+  for (auto& ends: foldLevelEnds)
+    ends.clear();
+  bool tooDeep = false;
+  for (const auto& ij: foldPairs) {
     const int i = ij.first, j = ij.second;
-    //      cerr << ij.first << " <--> " << ij.second << endl;
-    size_t offset;
-    for (offset = 0; offset < leftFoldChar.size(); ++offset) {
-      bool intersects = false;
-      for (const auto& op: offsetPairs[offset]) {
-	const int a = op.first, b = op.second;
-	if ((i < a && a < j && j < b)
-	    || (a < i && i < b && b < j)) {
-	  intersects = true;
-	  break;
-	}
-      }
-      if (!intersects)
+    size_t level;
+    for (level = 0; level < leftFoldChar.size(); ++level) {
+      if (level == foldLevelEnds.size())
+	foldLevelEnds.push_back (vguard<int>());
+      vguard<int>& ends = foldLevelEnds[level];
+      while (!ends.empty() && ends.back() < i)
+	ends.pop_back();
+      if (ends.empty() || ends.back() > j) {
+	ends.push_back (j);
 	break;
+      }
     }
-    if (offset < leftFoldChar.size()) {
-      offsetPairs[offset].insert (ij);
-      fs[ij.first] = leftFoldChar[offset];
-      fs[ij.second] = rightFoldChar[offset];
+    if (level < leftFoldChar.size()) {
+      foldChars[i] = leftFoldChar[level];
+      foldChars[j] = rightFoldChar[level];
     } else
-      cerr << "Not enough fold characters!" << endl;
+      tooDeep = true;
   }
-  return fs;
+  if (tooDeep)
+    cerr << "Not enough fold characters!" << endl;
+}
+
+string Board::foldString() const {
+  layoutFold();
+  return foldChars;
 }
 
 string Board::coloredFoldString() const {
-  const string fs = foldString();
-  vguard<int> col (fs.size(), 7);
+  if (coloredFoldVersion == structureVersion())
+    return coloredFold;
+  layoutFold();
+  const vguard<IndexPair>& foldPairs = pairList();
+  foldColor.assign (foldChars.size(), 7);
   int c = 1, last_i = -1, last_j = -1;
-  for (auto& ij: indexPairs()) {
+  for (auto& ij: foldPairs) {
     if (last_i >= 0 && (ij.first != last_i + 1 || ij.second != last_j - 1))
       c = (c % 6) + 1;
-    col[ij.first] = col[ij.second] = c;
+    foldColor[ij.first] = foldColor[ij.second] = c;
     last_i = ij.first;
     last_j = ij.second;
   }
-  string cfs;
-  cfs.reserve ((fs.size() + 1) * 6);
-  for (size_t pos = 0; pos < fs.size(); ++pos) {
-    const string ansi = string("\033[") + to_string(30+col[pos]) + "m" + fs[pos];
+  string& cfs = coloredFold;
+  cfs.clear();
+  cfs.reserve ((foldChars.size() + 1) * 6);
+  char ansi[] = "\033[30m";
+  for (size_t pos = 0; pos < foldChars.size(); ++pos) {
+    ansi[3] = '0' + foldColor[pos];
     cfs.append (ansi);
+    cfs.push_back (foldChars[pos]);
   }
   cfs.append ("\033[37m");
+  coloredFoldVersion = structureVersion();
   return cfs;
 }
 
 double Board::foldEnergy() const {
-  double e = 0;
-  for (const auto& ij: indexPairs())
-    e += calcEnergy (unit[ij.first], unit[ij.second], 0.5);
-  return e;
+  if (foldEnergyVersion != structureVersion()) {
+    double e = 0;
+    for (const auto& ij: pairList())
+      e += calcEnergy (unit[ij.first], unit[ij.second], 0.5);
+    foldEnergyCache = e;
+    foldEnergyVersion = structureVersion();
+  }
+  return foldEnergyCache;
 }
 
 vguard<Vec> Board::unitPos() const {
@@ -355,25 +716,32 @@ vguard<Vec> Board::unitPos() const {
   return up;
 }
 
+void Board::recenterPositionSums() const {
+  // keep posSqSum small (and the variance well-conditioned) by recentering once the centroid drifts far from posOrigin
+  const long long maxDrift = 1 << 12;
+  for (size_t n = 0; n < 3; ++n)
+    if (llabs (posSum[n]) > maxDrift * (long long) unit.size()) {
+      initPositionSums();
+      break;
+    }
+}
+
 vguard<double> Board::unitCentroid() const {
+  recenterPositionSums();
   vguard<double> c (3);
-  for (auto& u: unit)
-    for (size_t n = 0; n < 3; ++n)
-      c[n] += u.pos.xyz[n];
   for (size_t n = 0; n < 3; ++n)
-    c[n] /= unit.size();
+    c[n] = posOrigin.xyz[n] + posSum[n] / (double) unit.size();
   return c;
 }
 
 double Board::unitRadiusOfGyration() const {
-  const vguard<double> c = unitCentroid();
+  recenterPositionSums();
   double d2 = 0;
-  for (auto& u: unit)
-    for (size_t n = 0; n < 3; ++n) {
-      const double d = u.pos.xyz[n] - c[n]; 
-      d2 += d*d;
-    }
-  return sqrt (d2 / unit.size());
+  for (size_t n = 0; n < 3; ++n) {
+    const double mean = posSum[n] / (double) unit.size();
+    d2 += posSqSum[n] / (double) unit.size() - mean * mean;
+  }
+  return sqrt (max (d2, 0.));
 }
 
 map<string,int> Board::sequenceFreqs() const {
@@ -414,3 +782,158 @@ map<string,int> Board::sequenceFreqs() const {
     throw runtime_error ("Missed Units");
   return seqFreq;
 }
+
+void Board::countPairs (map<IndexPair,double>& pairCount) const {
+  for (const auto& ij: indexPairs())
+    pairCount[ij] += 1;
+}
+
+void Board::creditPairProbs (map<IndexPair,double>& pairCount, int windowSize) const {
+  vguard<bool> seen (unit.size(), false);
+  vguard<int> chain, window, cover;
+  vguard<double> share;
+  for (size_t i = 0; i < unit.size(); ++i) {
+    if (seen[i])
+      continue;
+    // find the chain's first Unit (any Unit, if it's circular), then list the chain
+    int first = i;
+    bool cyclic = false;
+    while (unit[first].prev >= 0 && !cyclic)
+      cyclic = (first = unit[first].prev) == (int) i;
+    chain.clear();
+    for (int j = first; j >= 0 && !seen[j]; j = unit[j].next) {
+      seen[j] = true;
+      chain.push_back (j);
+    }
+    const int n = chain.size();
+    if (n == 1) {
+      // free monomer: no local set of positions to sum over, so fall back to the realized pair
+      const int j = pairedIndex (unit[i]);
+      if (j >= 0)
+	pairCount[IndexPair (min ((int) i, j), max ((int) i, j))] += .5;
+      continue;
+    }
+    // every window leaves at least one chain neighbor in place, to anchor it
+    const int k = min (max (windowSize, 1), n - 1), windows = cyclic ? n : n - k + 1;
+    cover.assign (n, 0);
+    for (int w = 0; w < windows; ++w)
+      for (int t = 0; t < k; ++t)
+	++cover[(w + t) % n];
+    for (int w = 0; w < windows; ++w) {
+      window.clear();
+      share.clear();
+      for (int t = 0; t < k; ++t) {
+	window.push_back (chain[(w + t) % n]);
+	share.push_back (.5 / cover[(w + t) % n]);
+      }
+      creditWindow (window, share, pairCount);
+    }
+  }
+}
+
+void Board::creditWindow (const vguard<int>& window, const vguard<double>& share, map<IndexPair,double>& pairCount) const {
+  const int k = window.size();
+  auto inWindow = [&] (int i) {
+    for (int t = 0; t < k; ++t)
+      if (window[t] == i)
+	return t;
+    return -1;
+  };
+  // place the Units outwards from an anchoring chain neighbor: forwards from the left one, or backwards from the right one.
+  const int left = unit[window.front()].prev, right = unit[window.back()].next;
+  const bool forwards = left >= 0;
+  const int firstAnchor = forwards ? left : right, lastAnchor = forwards ? right : left;
+  auto order = [&] (int d) { return forwards ? d : k - 1 - d; };
+
+  vguard<Vec> pos (k);  // hypothetical positions of the window's Units
+  auto posOf = [&] (int i) -> const Vec& {
+    const int t = inWindow (i);
+    return t >= 0 ? pos[t] : unit[i].pos;
+  };
+  auto paired = [&] (int i, int j) {
+    return i >= 0 && j >= 0 && boardCoordsEqual (posOf(i), posOf(j));
+  };
+
+  vguard<vguard<Vec> > candidates (k);
+  vguard<int> cellSeen;
+  auto listCandidates = [&] (int d) {  // positions for the d'th Unit placed: next to the one placed before it
+    auto& cand = candidates[d];
+    cand.clear();
+    const Vec& from = d == 0 ? unit[firstAnchor].pos : pos[order(d-1)];
+    cellSeen.clear();
+    for (int n = -1; n < (int) neighborhood.size(); ++n) {
+      const Vec p = n < 0 ? from : (from + neighborhood[n]);
+      const int c = cellIndex (p.x(), p.y(), p.z(), false);
+      if (find (cellSeen.begin(), cellSeen.end(), c) == cellSeen.end()) {
+	cellSeen.push_back (c);
+	cand.push_back (p);
+      }
+    }
+  };
+
+  map<IndexPair,double> credit;
+  vguard<IndexPair> pairs;
+  double norm = 0;
+  auto addConformation = [&] () {
+    if (lastAnchor >= 0 && !adjacent (pos[order(k-1)], unit[lastAnchor].pos))
+      return;
+    // each window Unit may share its cell with one other Unit, which it must be able to pair with
+    pairs.clear();
+    for (int t = 0; t < k; ++t) {
+      const int x = window[t];
+      const int c = cellIndex (pos[t].x(), pos[t].y(), pos[t].z(), false);
+      int partner = -1, occupants = 0;
+      for (int slot = c; slot <= c + 1; ++slot)
+	if (cellStorage[slot] >= 0 && inWindow (cellStorage[slot]) < 0) {
+	  partner = cellStorage[slot];
+	  ++occupants;
+	}
+      for (int t2 = 0; t2 < k; ++t2)
+	if (t2 != t && boardCoordsEqual (pos[t2], pos[t])) {
+	  partner = window[t2];
+	  ++occupants;
+	}
+      if (occupants > 1 || (occupants == 1 && !canMergeWith (unit[x], unit[partner], paired)))
+	return;
+      if (partner >= 0 && (inWindow (partner) < 0 || x < partner))
+	pairs.push_back (IndexPair (x, partner));
+    }
+    // energy of the pairs involving the window; a stack between two of them is met from both, so counts half each time
+    double e = 0;
+    for (const auto& xy: pairs) {
+      const Unit& u = unit[xy.first];
+      const Unit& v = unit[xy.second];
+      e += basepairEnergy (u, v);
+      if (paired (u.prev, v.next))
+	e += params.stackEnergy * (inWindow (u.prev) >= 0 || inWindow (v.next) >= 0 ? .5 : 1);
+      if (paired (u.next, v.prev))
+	e += params.stackEnergy * (inWindow (u.next) >= 0 || inWindow (v.prev) >= 0 ? .5 : 1);
+    }
+    const double w = exp (e / params.temp);
+    norm += w;
+    for (const auto& xy: pairs) {
+      const IndexPair ij (min (xy.first, xy.second), max (xy.first, xy.second));
+      const int tx = inWindow (xy.first), ty = inWindow (xy.second);
+      credit[ij] += w * (share[tx] + (ty >= 0 ? share[ty] : 0));
+    }
+  };
+
+  // depth-first over the positions of each Unit in turn
+  vguard<size_t> next (k, 0);
+  listCandidates (0);
+  for (int d = 0; d >= 0; ) {
+    if (next[d] == candidates[d].size()) {
+      --d;
+      continue;
+    }
+    pos[order(d)] = candidates[d][next[d]++];
+    if (d + 1 < k) {
+      ++d;
+      listCandidates (d);
+      next[d] = 0;
+    } else
+      addConformation();
+  }
+  for (const auto& ij_w: credit)
+    pairCount[ij_w.first] += ij_w.second / norm;
+}
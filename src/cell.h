@@ -61,6 +61,86 @@ struct Params {
   json toJson() const;
 };
 
+// Classes of accepted move
+enum MoveType { NoMove = 0, FreeMove, PairedMove, SplitMove, SplitMergeMove, MergeMove, LigationMove, MoveTypes };
+
+// Outcome of a call to Board::tryMove
+enum MoveOutcome {
+  OutOfReach,  // rejected by canMoveTo
+  SplitAccepted, SplitRejected,  // paired Unit moves to an empty cell
+  SplitMergeAccepted, SplitMergeRejected,  // paired Unit moves to pair with another
+  SplitBlocked,  // split attempted, but no empty cell or compatible partner
+  PairedAccepted,  // paired Units move together
+  PairedBlocked,  // co-move blocked, and no ligation possible
+  LigationAccepted,
+  FreeAccepted,  // unpaired Unit moves to an empty cell
+  MergeAccepted, MergeRejected,  // unpaired Unit moves to pair with another
+  FreeBlocked,  // target occupied by an incompatible Unit or a pair
+  MoveOutcomes
+};
+
+// Aggregate counters for a block of moves. Outcome counts are only filled in by counting event hooks.
+struct MoveStats {
+  long tried, accepted;
+  long outcome[MoveOutcomes];
+  double seconds;  // time spent making the moves, as timed by the caller of Board::run
+  static const char* outcomeName[];
+  MoveStats() : tried(0), accepted(0), seconds(0) { fill (outcome, outcome + MoveOutcomes, 0); }
+  MoveStats& operator+= (const MoveStats& s) {
+    tried += s.tried;
+    accepted += s.accepted;
+    seconds += s.seconds;
+    for (int o = 0; o < MoveOutcomes; ++o)
+      outcome[o] += s.outcome[o];
+    return *this;
+  }
+  json toJson (double wallSeconds) const;  // rates are per second of stepping, not of wall time
+};
+
+// Event hooks for Board::tryMove. These ones do nothing and compile away.
+struct NullMoveEvents {
+  inline void nextMove() { }
+  inline void outcome (MoveOutcome) { }
+  inline void addCounts (MoveStats&) { }
+  inline void moved (int, int, MoveType) { }  // unit, direction (index into Board::neighborhood), move class
+  inline void paired (int, int) { }
+  inline void unpaired (int, int) { }
+  inline void ligated (int, int) { }  // first.next = second
+};
+
+// Event hooks that record events, stamped with the current move number
+struct MoveEvent {
+  enum Kind { Moved, Paired, Unpaired, Ligated } kind;
+  MoveType type;
+  int i, j;
+  long move;
+  MoveEvent (Kind k, MoveType t, int a, int b, long m) : kind(k), type(t), i(a), j(b), move(m) { }
+};
+
+// Event hooks that count outcomes
+struct MoveCounter : NullMoveEvents {
+  long count[MoveOutcomes];
+  MoveCounter() { fill (count, count + MoveOutcomes, 0); }
+  inline void outcome (MoveOutcome o) { ++count[o]; }
+  inline void addCounts (MoveStats& stats) {
+    for (int o = 0; o < MoveOutcomes; ++o) {
+      stats.outcome[o] += count[o];
+      count[o] = 0;
+    }
+  }
+};
+
+struct MoveEventLog : MoveCounter {
+  vguard<MoveEvent> event;
+  long move;
+  MoveEventLog() : move(0) { }
+  inline void nextMove() { ++move; }
+  inline void moved (int i, int, MoveType t) { event.push_back (MoveEvent (MoveEvent::Moved, t, i, -1, move)); }
+  inline void paired (int i, int j) { event.push_back (MoveEvent (MoveEvent::Paired, NoMove, i, j, move)); }
+  inline void unpaired (int i, int j) { event.push_back (MoveEvent (MoveEvent::Unpaired, NoMove, i, j, move)); }
+  inline void ligated (int i, int j) { event.push_back (MoveEvent (MoveEvent::Ligated, NoMove, i, j, move)); }
+};
+
 struct Board {
   typedef pair<int,int> IndexPair;
   vguard<int> cellStorage;
@@ -83,9 +163,42 @@ struct Board {
   inline static int nbrRange (int size) {
     return size > 1 ? 1 : 0;
   }
+  inline static int imageCoord (int val, int size) {  // shortest signed displacement equivalent to val
+    if (val >= -1 && val <= 1 && size > 2)
+      return val;
+    const int m = boardCoord (val, size);
+    return 2 * m > size ? (m - size) : m;
+  }
+  inline Vec minimumImage (const Vec& d) const {
+    return Vec (imageCoord (d.x(), xSize), imageCoord (d.y(), ySize), imageCoord (d.z(), zSize));
+  }
   int xSize, ySize, zSize;
   Params params;
   vguard<Unit> unit;
+
+  // Unit positions are unwrapped: moveUnit displaces a Unit by the minimum image of its move,
+  // so each chain stays contiguous in unbounded coordinates while cell() wraps them onto the board.
+  // Running sums of positions (relative to posOrigin) give O(1) centroid & radius of gyration.
+  mutable Vec posOrigin;
+  mutable long long posSum[3], posSqSum[3];
+
+  // Modification counters, bumped by tryMove (and moveUnit) when basepairs, chain bonds or positions change.
+  // Code that edits units or cells directly must call touch().
+  // Single-chain observables below are memoized against pair & chain versions.
+  unsigned long long pairVersion, chainVersion, posVersion;
+  inline void touch() { ++pairVersion; ++chainVersion; ++posVersion; }
+  inline unsigned long long structureVersion() const { return pairVersion + chainVersion; }  // changes if either does
+
+  // Dirty tracking, for incremental checkpoints.
+  // Units written by moves are marked in bricks of (1 << unitBrickShift) consecutive Units, by running with DirtyUnitTracker.
+  // Cells aren't tracked: they follow from the Units' positions.
+  static const int unitBrickShift = 0;  // moves touch Units at random, so single-Unit bricks give the smallest deltas
+  vguard<unsigned char> unitBrickDirty;  // empty if tracking is off
+  inline void markDirty (int index) {
+    unitBrickDirty[index >> unitBrickShift] = 1;
+  }
+  void trackDirtyUnits (bool track);
+  void clearDirtyUnits();
   
   Board (int, int, int);
   Board();
@@ -93,12 +206,26 @@ struct Board {
   static Board fromJson (json&);
   json toJson() const;
 
+  void copyStateFrom (const Board&, bool copyCells = true);  // snapshot, reusing this Board's storage & caches
+
   void addSeq (const string&);  // adds sequence along x-axis starting at origin
   void addBases (double, mt19937&);  // adds random monomeric bases with given density
   
   const Vec& rndNbrVec (mt19937&) const;
 
+  void unwrapChains();  // make each chain contiguous in unwrapped coordinates
+  void unwrapFrom (int);  // after ligation, shift the rest of the chain to be contiguous with the given Unit
+  void initPositionSums() const;  // recompute posSum & posSqSum from scratch
+  void recenterPositionSums() const;
+
+  // Consistency checks; these throw runtime_error on failure.
+  // assertValid checks the whole board in O(cells + units).
+  // assertValidLocal checks only the given cell (e.g. the one a Unit just left) and the given Units,
+  // with their basepair partners and chain neighbors; in DEBUG builds tryMove calls it after every accepted move.
   void assertValid() const;
+  void assertValidLocal (const Vec& oldPos, int i, int j = -1, int k = -1) const;
+  void assertValidCell (const Vec& pos) const;
+  void assertValidUnit (int) const;
 
   inline static int shortestDistance (int c1, int c2, int size) {
     const int d = boardCoord (c1 - c2, size);
@@ -126,6 +253,11 @@ struct Board {
     return i >= 0 && j >= 0 && boardCoordsEqual (unit[i].pos, unit[j].pos);
   }
   inline bool canMerge (const Unit& u, const Unit& v) const {
+    return canMergeWith (u, v, [this] (int i, int j) { return indicesPaired (i, j); });
+  }
+  // canMerge, given a test of whether two Units are paired (e.g. with some Units at hypothetical positions)
+  template<class Paired>
+  inline bool canMergeWith (const Unit& u, const Unit& v, Paired paired) const {
     if (!u.isComplementOrWobble(v))
       return false;
     if (u.next == v.index || v.next == u.index)  // disallow neighbors
@@ -140,18 +272,19 @@ struct Board {
 	&& (u_prev2 == v.index
 	    || u_prev2 == v.next))
       return false;
-  return (!indicesPaired (u.prev, v.prev)  // disallow parallel stacking
-	  && !indicesPaired (u.next, v.next));
+  return (!paired (u.prev, v.prev)  // disallow parallel stacking
+	  && !paired (u.next, v.next));
   }
-  inline double calcEnergy (const Unit& u, const Unit& v, double stackWeight) const {
-    double e = 0;
-    const int bprod = u.base * v.base;
-    switch (bprod) {
-    case 0: e += params.auEnergy; break;
-    case 2: e += params.gcEnergy; break;
-    case 6: e += params.guEnergy; break;
-    default: throw runtime_error("Not a basepair"); break;
+  inline double basepairEnergy (const Unit& u, const Unit& v) const {  // without stacking
+    switch (u.base * v.base) {
+    case 0: return params.auEnergy;
+    case 2: return params.gcEnergy;
+    case 6: return params.guEnergy;
+    default: throw runtime_error("Not a basepair");
     }
+  }
+  inline double calcEnergy (const Unit& u, const Unit& v, double stackWeight) const {
+    double e = basepairEnergy (u, v);
     if (indicesPaired (u.prev, v.next))
       e += params.stackEnergy * stackWeight;
     if (indicesPaired (u.next, v.prev))
@@ -169,14 +302,29 @@ struct Board {
   inline void moveUnit (Unit& u, const Vec& pos, bool rev) {
     //    cerr << "before move..." << endl; dump(cerr);
     cell (u.pos, u.rev) = -1;
-    u.pos = pos;
+    const Vec d = minimumImage (pos - u.pos);
+    for (size_t n = 0; n < 3; ++n) {
+      posSum[n] += d.xyz[n];
+      posSqSum[n] += (long long) d.xyz[n] * (2 * (u.pos.xyz[n] - posOrigin.xyz[n]) + d.xyz[n]);
+    }
+    u.pos = u.pos + d;
     u.rev = rev;
+    ++posVersion;
     cell (u.pos, u.rev) = u.index;
     //    cerr << u.pos << "." << u.rev << endl;
     //    cerr << "after move..." << endl; dump(cerr);
   }
   
   bool tryMove (mt19937&);
+  template<class Events> bool tryMove (mt19937&, Events&);  // instantiated for NullMoveEvents, MoveCounter, MoveEventLog, DirtyUnitTracker & MoveJournal
+
+  // re-apply a move that tryMove accepted, as reported to Events::moved, without drawing random numbers;
+  // the Events receive the same moved/paired/unpaired/ligated calls (but no outcomes). Instantiated for NullMoveEvents & MoveEventLog
+  template<class Events> void replayMove (int index, int dir, MoveType type, Events&);
+
+  // run a block of moves in a tight loop, accumulating counters in the MoveStats
+  void run (long count, mt19937&, MoveStats&);
+  template<class Events> void run (long count, mt19937&, MoveStats&, Events&);  // Events.move should be set to the first move
   void dump (ostream&) const;
   
   inline const int& cell (int x, int y, int z, bool rev) const {
@@ -195,16 +343,58 @@ struct Board {
   // single-chain logging
   void assertLinear() const;
   vguard<IndexPair> indexPairs() const;
+  void indexPairs (vguard<IndexPair>&) const;  // uncached
+  const vguard<IndexPair>& pairList() const;  // cached
   string sequence() const;
   vguard<Vec> unitPos() const;
-  vguard<double> unitCentroid() const;
-  double unitRadiusOfGyration() const;
+  vguard<double> unitCentroid() const;  // O(1)
+  double unitRadiusOfGyration() const;  // O(1)
   string foldString() const;
   double foldEnergy() const;
   string coloredFoldString() const;
+  void layoutFold() const;  // fills foldChars
+
+  // caches & buffers for single-chain observables, reused across calls
+  mutable unsigned long long pairListVersion, layoutVersion, coloredFoldVersion, foldEnergyVersion;
+  mutable vguard<IndexPair> pairListCache;
+  mutable string foldChars, coloredFold;
+  mutable vguard<vguard<int> > foldLevelEnds;
+  mutable vguard<int> foldColor;
+  mutable double foldEnergyCache;
 
   // multi-chain logging
   map<string,int> sequenceFreqs() const;
+
+  // base-pairing probability estimators
+  // countPairs credits each realized pair with weight 1.
+  // creditPairProbs is a Rao-Blackwellized alternative: for every window of consecutive chained Units,
+  // each joint position the window could take (given the rest of the board) is weighted by its Boltzmann factor,
+  // and each Unit credits its pairs with their conditional probabilities, averaged over the windows containing it.
+  // Each pair receives half the credit from either end, so the expected credit per sample is the same.
+  // Wider windows can re-place a stacked neighbor too, at a cost of 9 (2D) or 27 (3D) times as many positions per Unit.
+  void countPairs (map<IndexPair,double>&) const;
+  void creditPairProbs (map<IndexPair,double>&, int window = 2) const;
+  void creditWindow (const vguard<int>& window, const vguard<double>& share, map<IndexPair,double>&) const;
+};
+
+// Event hooks that count outcomes and mark the Units each accepted move wrote in Board::unitBrickDirty.
+// Tracking this way, rather than in moveUnit, keeps it out of untracked runs altogether.
+struct DirtyUnitTracker : MoveCounter {
+  Board* board;
+  DirtyUnitTracker (Board* b = NULL) : board(b) { }
+  inline void moved (int i, int, MoveType t) {
+    board->markDirty (i);
+    if (t == PairedMove)
+      board->markDirty (board->pairedIndex (board->unit[i]));
+  }
+  inline void unpaired (int i, int j) {  // the partner flips strand
+    board->markDirty (j);
+  }
+  inline void ligated (int i, int j) {  // the new bond, and the rest of the chain that unwrapFrom shifted
+    board->markDirty (i);
+    for (int k = j; k >= 0 && k != i; k = board->unit[k].next)
+      board->markDirty (k);
+  }
 };
 
 #endif /* CELL_INCLUDED */
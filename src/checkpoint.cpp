@@ -0,0 +1,339 @@
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "checkpoint.h"
+#include "boardfile.h"
+
+const char Checkpoint::magicString[] = "CARNACKP";
+const char Checkpoint::deltaMagicString[] = "CARNADLT";
+
+static void writeU64 (ostream& out, uint64_t n) {
+  out.write ((const char*) &n, sizeof(n));
+}
+
+static void writeU32 (ostream& out, uint32_t n) {
+  out.write ((const char*) &n, sizeof(n));
+}
+
+// magic, version, replica count, and the run state with the RNGs & chain position folded in
+static void writePreamble (ostream& out, const char* magic, const json& state, const vguard<Board>& replica, const vguard<mt19937>& rng, uint64_t baseId, int delta) {
+  if (replica.size() != rng.size())
+    throw runtime_error ("Checkpoint needs one random number generator per replica");
+  json meta = state;
+  meta["rng"] = json::array();
+  for (const auto& mt: rng) {
+    ostringstream s;
+    s << mt;
+    meta["rng"].push_back (s.str());
+  }
+  meta["base"] = baseId;
+  meta["delta"] = delta;
+  const string metaText = meta.dump();
+
+  out.write (magic, 8);
+  writeU32 (out, Checkpoint::currentVersion);
+  writeU32 (out, replica.size());
+  writeU64 (out, metaText.size());
+  out.write (metaText.data(), metaText.size());
+}
+
+// bounds-checked reader over a mapped checkpoint file
+struct CheckpointReader {
+  MappedFile file;
+  const char *p, *end;
+  uint32_t replicas;
+  json meta;
+  CheckpointReader (const string& filename, const char* magic)
+    : file (filename), p (file.data), end (file.data + file.size)
+  {
+    need (16);
+    if (memcmp (p, magic, 8) != 0)
+      throw runtime_error (string ("Not a checkpoint file: ") + filename);
+    uint32_t version;
+    memcpy (&version, p + 8, sizeof(version));
+    memcpy (&replicas, p + 12, sizeof(replicas));
+    p += 16;
+    if (version > Checkpoint::currentVersion)
+      throw runtime_error ("Unsupported checkpoint version");
+    const uint64_t metaSize = readU64();
+    need (metaSize);
+    meta = json::parse (string (p, metaSize));
+    p += metaSize;
+  }
+  void need (size_t n) const {
+    if ((size_t) (end - p) < n)
+      throw runtime_error ("Checkpoint file is truncated");
+  }
+  uint64_t readU64() {
+    need (sizeof(uint64_t));
+    uint64_t n;
+    memcpy (&n, p, sizeof(n));
+    p += sizeof(n);
+    return n;
+  }
+  uint32_t readU32() {
+    need (sizeof(uint32_t));
+    uint32_t n;
+    memcpy (&n, p, sizeof(n));
+    p += sizeof(n);
+    return n;
+  }
+  void readRng (vguard<mt19937>& rng) {
+    const json& jr = meta.at ("rng");
+    if (jr.size() != replicas)
+      throw runtime_error ("Checkpoint has the wrong number of random number generators");
+    rng = vguard<mt19937> (replicas);
+    for (uint32_t r = 0; r < replicas; ++r) {
+      istringstream s (jr[r].get<string>());
+      s >> rng[r];
+    }
+  }
+  json state() const {
+    json s = meta;
+    s.erase ("rng");
+    s.erase ("base");
+    s.erase ("delta");
+    return s;
+  }
+};
+
+void Checkpoint::write (ostream& out, const json& state, const vguard<Board>& replica, const vguard<mt19937>& rng, uint64_t baseId) {
+  writePreamble (out, magicString, state, replica, rng, baseId, 0);
+  for (const auto& board: replica) {
+    writeU64 (out, binaryBoardSize (board));
+    writeBinaryBoard (board, out);
+  }
+}
+
+// per replica: uint64 units, uint32 brick shift, uint32 reserved, uint64 bricks,
+// then for each dirty brick its uint64 index followed by its PackedUnits
+void Checkpoint::writeDelta (ostream& out, int delta, const json& state, const vguard<Board>& replica, const vguard<mt19937>& rng, uint64_t baseId) {
+  writePreamble (out, deltaMagicString, state, replica, rng, baseId, delta);
+  vguard<PackedUnit> packed;
+  for (const auto& board: replica) {
+    if (board.unitBrickDirty.empty())
+      throw runtime_error ("Delta checkpoint needs dirty unit tracking");
+    const uint64_t bricks = count (board.unitBrickDirty.begin(), board.unitBrickDirty.end(), 1);
+    writeU64 (out, board.unit.size());
+    writeU32 (out, Board::unitBrickShift);
+    writeU32 (out, 0);
+    writeU64 (out, bricks);
+    for (size_t b = 0; b < board.unitBrickDirty.size(); ++b)
+      if (board.unitBrickDirty[b]) {
+	writeU64 (out, b);
+	packed.clear();
+	for (size_t n = b << Board::unitBrickShift; n < board.unit.size() && n < (b + 1) << Board::unitBrickShift; ++n)
+	  packed.push_back (packUnit (board.unit[n]));
+	out.write ((const char*) packed.data(), packed.size() * sizeof(PackedUnit));
+      }
+  }
+}
+
+void Checkpoint::commit (const string& tmpFilename, const string& filename) {
+  const int fd = open (tmpFilename.c_str(), O_RDONLY);
+  if (fd < 0 || fsync (fd) < 0)
+    throw runtime_error (string ("Can't sync checkpoint ") + tmpFilename);
+  close (fd);
+  if (rename (tmpFilename.c_str(), filename.c_str()) < 0)
+    throw runtime_error (string ("Can't rename checkpoint to ") + filename);
+}
+
+string Checkpoint::deltaFilename (const string& filename, int delta) {
+  return filename + "." + to_string (delta);
+}
+
+uint64_t Checkpoint::newBaseId() {
+  random_device rd;
+  return (((uint64_t) rd()) << 32) ^ rd() ^ (uint64_t) chrono::system_clock::now().time_since_epoch().count();
+}
+
+static void writeAtomically (const string& filename, const function<void(ostream&)>& write) {
+  const string tmpFilename = filename + ".tmp";
+  {
+    ofstream out (tmpFilename, ios::binary);
+    if (!out)
+      throw runtime_error (string ("Can't write checkpoint ") + tmpFilename);
+    write (out);
+    out.close();
+    if (!out)
+      throw runtime_error (string ("Error writing checkpoint ") + tmpFilename);
+  }
+  Checkpoint::commit (tmpFilename, filename);
+}
+
+void Checkpoint::save (const string& filename, const json& state, const vguard<Board>& replica, const vguard<mt19937>& rng, uint64_t baseId) {
+  writeAtomically (filename, [&] (ostream& out) { write (out, state, replica, rng, baseId); });
+  // compact: the deltas of the previous base are now obsolete
+  for (int delta = 1; unlink (deltaFilename (filename, delta).c_str()) == 0; ++delta)
+    ;
+}
+
+void Checkpoint::saveDelta (const string& filename, int delta, const json& state, const vguard<Board>& replica, const vguard<mt19937>& rng, uint64_t baseId) {
+  writeAtomically (deltaFilename (filename, delta), [&] (ostream& out) { writeDelta (out, delta, state, replica, rng, baseId); });
+}
+
+void Checkpoint::save (const string& filename) const {
+  save (filename, state, replica, rng);
+}
+
+void Checkpoint::load (const string& filename) {
+  CheckpointReader in (filename, magicString);
+  replica.clear();
+  for (uint32_t r = 0; r < in.replicas; ++r) {
+    const uint64_t boardSize = in.readU64();
+    in.need (boardSize);
+    replica.push_back (readBinaryBoard (in.p, boardSize));
+    in.p += boardSize;
+  }
+  in.readRng (rng);
+  state = in.state();
+
+  const uint64_t baseId = in.meta.value ("base", (uint64_t) 0);
+  if (baseId)
+    for (int delta = 1; applyDelta (filename, delta, baseId); ++delta)
+      ;
+}
+
+bool Checkpoint::applyDelta (const string& filename, int delta, uint64_t baseId) {
+  const string deltaFile = deltaFilename (filename, delta);
+  if (access (deltaFile.c_str(), R_OK) != 0)
+    return false;
+  CheckpointReader in (deltaFile, deltaMagicString);
+  if (in.meta.at("base").get<uint64_t>() != baseId || in.meta.at("delta").get<int>() != delta)
+    return false;  // left over from an older base
+  if (in.replicas != replica.size())
+    throw runtime_error ("Delta checkpoint has the wrong number of replicas");
+
+  for (auto& board: replica) {
+    const uint64_t units = in.readU64();
+    const uint32_t shift = in.readU32();
+    in.readU32();
+    const uint64_t bricks = in.readU64();
+    if (units != board.unit.size())
+      throw runtime_error ("Delta checkpoint has the wrong number of units");
+    // vacate the changed Units' old cells before filling their new ones, since Units may swap cells
+    vguard<int> changed;
+    for (uint64_t b = 0; b < bricks; ++b) {
+      const uint64_t first = in.readU64() << shift;
+      const uint64_t last = min (units, first + (1 << shift));
+      if (first >= units)
+	throw runtime_error ("Delta checkpoint has a bad brick index");
+      in.need ((last - first) * sizeof(PackedUnit));
+      const PackedUnit* pu = (const PackedUnit*) in.p;
+      for (uint64_t n = first; n < last; ++n) {
+	Unit& u = board.unit[n];
+	if (board.cell (u.pos, u.rev) == (int) n)
+	  board.cell (u.pos, u.rev) = -1;
+	u = unpackUnit (pu[n - first], n, units);
+	changed.push_back (n);
+      }
+      in.p += (last - first) * sizeof(PackedUnit);
+    }
+    for (int n: changed) {
+      const Unit& u = board.unit[n];
+      board.cell (u.pos, u.rev) = n;
+    }
+    board.assertValid();
+    board.unwrapChains();
+    board.initPositionSums();
+    board.touch();
+  }
+
+  in.readRng (rng);
+  state = in.state();
+  return true;
+}
+
+BackgroundCheckpointer::~BackgroundCheckpointer() {
+  if (child > 0)
+    waitpid (child, NULL, 0);
+}
+
+void BackgroundCheckpointer::reap (int status) {
+  child = -1;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    throw runtime_error ("Background checkpoint failed");
+}
+
+bool BackgroundCheckpointer::busy() {
+  if (child <= 0)
+    return false;
+  int status;
+  const pid_t pid = waitpid (child, &status, WNOHANG);
+  if (pid == 0)
+    return true;
+  if (pid < 0)
+    throw runtime_error ("Lost background checkpoint process");
+  reap (status);
+  return false;
+}
+
+bool BackgroundCheckpointer::start (const function<void()>& write) {
+  if (busy())
+    return false;
+  const pid_t pid = fork();
+  if (pid < 0)
+    throw runtime_error ("Can't fork checkpoint process");
+  if (pid == 0) {
+    // child: write the frozen state, then exit without running destructors or flushing inherited buffers
+    int status = 0;
+    try {
+      write();
+    } catch (const exception& e) {
+      cerr << e.what() << endl;
+      status = 1;
+    }
+    _exit (status);
+  }
+  child = pid;
+  return true;
+}
+
+void BackgroundCheckpointer::finish() {
+  if (child <= 0)
+    return;
+  int status;
+  if (waitpid (child, &status, 0) < 0)
+    throw runtime_error ("Lost background checkpoint process");
+  reap (status);
+}
+
+json pairCountToJson (const map<Board::IndexPair,double>& pairCount) {
+  json j = json::array();
+  for (const auto& ij_n: pairCount)
+    j.push_back ({ ij_n.first.first, ij_n.first.second, ij_n.second });
+  return j;
+}
+
+map<Board::IndexPair,double> pairCountFromJson (const json& j) {
+  map<Board::IndexPair,double> pairCount;
+  for (const auto& ijn: j)
+    pairCount[Board::IndexPair (ijn[0].get<int>(), ijn[1].get<int>())] = ijn[2].get<double>();
+  return pairCount;
+}
+
+json moveStatsToJson (const MoveStats& stats) {
+  json j;
+  j["tried"] = stats.tried;
+  j["accepted"] = stats.accepted;
+  j["outcome"] = vector<long> (stats.outcome, stats.outcome + MoveOutcomes);
+  j["seconds"] = stats.seconds;
+  return j;
+}
+
+MoveStats moveStatsFromJson (const json& j) {
+  MoveStats stats;
+  stats.tried = j.at("tried").get<long>();
+  stats.accepted = j.at("accepted").get<long>();
+  const vector<long> outcome = j.at("outcome").get<vector<long> >();
+  copy (outcome.begin(), outcome.begin() + min ((size_t) MoveOutcomes, outcome.size()), stats.outcome);
+  stats.seconds = j.value ("seconds", 0.);
+  return stats;
+}
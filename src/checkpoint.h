@@ -0,0 +1,69 @@
+#ifndef CHECKPOINT_INCLUDED
+#define CHECKPOINT_INCLUDED
+
+#include <functional>
+#include <sys/types.h>
+#include "cell.h"
+
+// Restartable checkpoints.
+// A checkpoint holds every replica's Board and random number generator, plus a JSON object of run state
+// (move counter, statistics, accumulated pair counts...) supplied by the driver.
+// Layout: magic "CARNACKP", uint32 version, uint32 replicas, then length-prefixed JSON and binary boards.
+// Checkpoints are written to a temporary file, synced and renamed over the old one,
+// so a crash mid-write leaves the previous checkpoint intact.
+//
+// Incremental checkpoints: a full (base) checkpoint FILE may be followed by deltas FILE.1, FILE.2, ...
+// Each delta holds the run state, and the bricks of Units that were written (Board::unitBrickDirty) since the one before.
+// Deltas name their base by a random id, so deltas left over from an older base are ignored.
+// Writing a full checkpoint compacts the chain, removing the old deltas.
+
+struct Checkpoint {
+  json state;
+  vguard<Board> replica;
+  vguard<mt19937> rng;
+
+  static const char magicString[], deltaMagicString[];
+  static const uint32_t currentVersion = 1;
+
+  void save (const string& filename) const;
+  void load (const string& filename);  // loads the base, then replays any deltas made since it
+
+  // write a checkpoint straight from the driver's arrays, without copying the boards
+  static void save (const string& filename, const json& state, const vguard<Board>& replica, const vguard<mt19937>& rng, uint64_t baseId = 0);
+  static void saveDelta (const string& filename, int delta, const json& state, const vguard<Board>& replica, const vguard<mt19937>& rng, uint64_t baseId);
+  static string deltaFilename (const string& filename, int delta);
+  static uint64_t newBaseId();
+
+  static void write (ostream& out, const json& state, const vguard<Board>& replica, const vguard<mt19937>& rng, uint64_t baseId = 0);
+  static void writeDelta (ostream& out, int delta, const json& state, const vguard<Board>& replica, const vguard<mt19937>& rng, uint64_t baseId);
+  static void commit (const string& tmpFilename, const string& filename);  // fsync & atomically rename
+
+private:
+  bool applyDelta (const string& filename, int delta, uint64_t baseId);
+};
+
+// Writes checkpoints from a forked child process, so the simulation pauses only for the fork;
+// copy-on-write keeps the frozen state's memory overhead to the pages the parent touches meanwhile.
+// One checkpoint is written at a time; start() returns false, and does nothing, while the last is still being written.
+// The child allocates and does I/O, so start() must only be called while the process has no other threads.
+class BackgroundCheckpointer {
+public:
+  BackgroundCheckpointer() : child(-1) { }
+  ~BackgroundCheckpointer();
+  bool busy();
+  bool start (const function<void()>& write);  // calls write() in the child
+  void finish();  // wait for the child, throwing if it failed
+private:
+  pid_t child;
+  void reap (int status);
+  BackgroundCheckpointer (const BackgroundCheckpointer&) = delete;
+  BackgroundCheckpointer& operator= (const BackgroundCheckpointer&) = delete;
+};
+
+// JSON encodings of run state
+json pairCountToJson (const map<Board::IndexPair,double>& pairCount);
+map<Board::IndexPair,double> pairCountFromJson (const json&);
+json moveStatsToJson (const MoveStats&);
+MoveStats moveStatsFromJson (const json&);
+
+#endif /* CHECKPOINT_INCLUDED */
@@ -0,0 +1,230 @@
+#include <limits>
+#include <set>
+#include "converge.h"
+
+double seriesMean (const vguard<double>& x, size_t start) {
+  double sum = 0;
+  for (size_t i = start; i < x.size(); ++i)
+    sum += x[i];
+  return x.size() > start ? (sum / (x.size() - start)) : 0;
+}
+
+double seriesVariance (const vguard<double>& x, size_t start) {
+  const double mean = seriesMean (x, start);
+  double sum = 0;
+  for (size_t i = start; i < x.size(); ++i)
+    sum += (x[i] - mean) * (x[i] - mean);
+  return x.size() > start ? (sum / (x.size() - start)) : 0;
+}
+
+double autocorrelationTime (const vguard<double>& x, size_t start) {
+  const size_t n = x.size() > start ? (x.size() - start) : 0;
+  const double mean = seriesMean (x, start), var = seriesVariance (x, start);
+  if (n < 2 || var <= 0)
+    return 1;
+  double tau = 1;
+  for (size_t lag = 1; lag < n; ++lag) {
+    double c = 0;
+    for (size_t i = start; i + lag < x.size(); ++i)
+      c += (x[i] - mean) * (x[i+lag] - mean);
+    tau += 2 * c / (n * var);
+    if (lag >= 5 * tau)  // Sokal's adaptive window
+      break;
+  }
+  return max (tau, 1.);
+}
+
+size_t equilibrationIndex (const vguard<double>& x) {
+  const size_t n = x.size();
+  vguard<double> s1 (n + 1), s2 (n + 1);  // suffix sums
+  for (size_t i = n; i > 0; --i) {
+    s1[i-1] = s1[i] + x[i-1];
+    s2[i-1] = s2[i] + x[i-1] * x[i-1];
+  }
+  size_t best = 0;
+  double bestMser = numeric_limits<double>::infinity();
+  for (size_t d = 0; d <= n / 2 && d < n; ++d) {
+    const double m = n - d;
+    const double mser = (s2[d] - s1[d] * s1[d] / m) / (m * m);
+    if (mser < bestMser) {
+      bestMser = mser;
+      best = d;
+    }
+  }
+  return best;
+}
+
+double gelmanRubin (const vguard<double>& chainMeans, const vguard<double>& chainVars, double samplesPerChain) {
+  const double w = seriesMean (chainVars);
+  const double bOverN = seriesVariance (chainMeans) * chainMeans.size() / (chainMeans.size() - 1);
+  if (w <= 0)
+    return bOverN > 0 ? numeric_limits<double>::infinity() : 1;
+  const double v = (samplesPerChain - 1) / samplesPerChain * w + bOverN;
+  return sqrt (v / w);
+}
+
+ConvergenceMonitor::ConvergenceMonitor (int replicas, double prec)
+  : precision(prec), maxRhat(1.1), minEss(50), maxBatches(64), minBatches(8), batchSize(8),
+    energy(replicas), batch(replicas),
+    burnIn(0), tau(replicas,1.), ess(replicas,0.),
+    pairStdErr(numeric_limits<double>::infinity()), pairRhat(numeric_limits<double>::infinity())
+{ }
+
+void ConvergenceMonitor::addSample (const vguard<double>& foldEnergy, const vguard<PairWeights>& pairWeights) {
+  const long sample = samples();
+  if (batch[0].empty() || batch[0].back().samples == batchSize) {
+    if (batch[0].size() == 2 * maxBatches)
+      mergeBatches();
+    for (auto& rb: batch)
+      rb.push_back (Batch (sample));
+  }
+  for (int r = 0; r < replicas(); ++r) {
+    energy[r].push_back (foldEnergy[r]);
+    Batch& b = batch[r].back();
+    for (const auto& ij_w: pairWeights[r])
+      b.weight[ij_w.first] += ij_w.second;
+    ++b.samples;
+  }
+}
+
+void ConvergenceMonitor::mergeBatches() {
+  for (auto& rb: batch) {
+    vguard<Batch> merged;
+    for (size_t k = 0; k + 1 < rb.size(); k += 2) {
+      Batch b (rb[k].firstSample);
+      b.samples = rb[k].samples + rb[k+1].samples;
+      b.weight.swap (rb[k].weight);
+      for (const auto& ij_w: rb[k+1].weight)
+	b.weight[ij_w.first] += ij_w.second;
+      merged.push_back (b);
+    }
+    rb.swap (merged);
+  }
+  batchSize *= 2;
+}
+
+size_t ConvergenceMonitor::firstRetainedBatch() const {
+  size_t k = 0;
+  while (k < batch[0].size() && batch[0][k].firstSample < burnIn)
+    ++k;
+  return k;
+}
+
+bool ConvergenceMonitor::converged() {
+  if (batch[0].empty() || batch[0].back().samples < batchSize)
+    return false;
+  burnIn = 0;
+  for (const auto& e: energy)
+    burnIn = max (burnIn, (long) equilibrationIndex (e));
+  double minReplicaEss = numeric_limits<double>::infinity();
+  for (int r = 0; r < replicas(); ++r) {
+    tau[r] = autocorrelationTime (energy[r], burnIn);
+    ess[r] = (energy[r].size() - burnIn) / tau[r];
+    minReplicaEss = min (minReplicaEss, ess[r]);
+  }
+
+  // batch means over complete, post-burn-in batches
+  const size_t first = firstRetainedBatch();
+  size_t last = batch[0].size();
+  if (last > first && batch[0][last-1].samples < batchSize)
+    --last;
+  pairStdErr = pairRhat = numeric_limits<double>::infinity();
+  if (last < first + minBatches)
+    return false;
+  const size_t nBatches = last - first;
+
+  set<IndexPair> pairs;
+  for (const auto& rb: batch)
+    for (size_t k = first; k < last; ++k)
+      for (const auto& ij_w: rb[k].weight)
+	pairs.insert (ij_w.first);
+
+  pairStdErr = 0;
+  pairRhat = 1;
+  vguard<double> pooled (replicas() * nBatches), chainMeans (replicas()), chainVars (replicas()), chain (nBatches);
+  for (const auto& ij: pairs) {
+    for (int r = 0; r < replicas(); ++r) {
+      for (size_t k = first; k < last; ++k) {
+	const auto iter = batch[r][k].weight.find (ij);
+	chain[k-first] = (iter == batch[r][k].weight.end() ? 0 : iter->second) / batch[r][k].samples;
+	pooled[r * nBatches + k - first] = chain[k-first];
+      }
+      chainMeans[r] = seriesMean (chain);
+      chainVars[r] = seriesVariance (chain) * nBatches / (nBatches - 1);
+    }
+    const double k = pooled.size();
+    pairStdErr = max (pairStdErr, sqrt (seriesVariance (pooled) / (k - 1)));
+    if (replicas() > 1)
+      pairRhat = max (pairRhat, gelmanRubin (chainMeans, chainVars, nBatches));
+  }
+
+  return minReplicaEss >= minEss
+    && pairStdErr <= precision
+    && (replicas() == 1 || pairRhat <= maxRhat);
+}
+
+long ConvergenceMonitor::pairSamples() const {
+  long n = 0;
+  for (const auto& rb: batch)
+    for (size_t k = firstRetainedBatch(); k < rb.size(); ++k)
+      n += rb[k].samples;
+  return n;
+}
+
+ConvergenceMonitor::PairWeights ConvergenceMonitor::pairWeights() const {
+  PairWeights w;
+  for (const auto& rb: batch)
+    for (size_t k = firstRetainedBatch(); k < rb.size(); ++k)
+      for (const auto& ij_w: rb[k].weight)
+	w[ij_w.first] += ij_w.second;
+  return w;
+}
+
+json ConvergenceMonitor::report() const {
+  json j;
+  j["samples"] = samples();
+  j["burnIn"] = burnIn;
+  j["batchSize"] = batchSize;
+  j["tau"] = tau;
+  j["ess"] = ess;
+  j["pairStdErr"] = pairStdErr;
+  if (replicas() > 1)
+    j["pairRhat"] = pairRhat;
+  return j;
+}
+
+AdaptivePeriod::AdaptivePeriod (long initialPeriod, int observables, size_t w)
+  : period(initialPeriod), minPeriod(1), maxPeriod(numeric_limits<long>::max() / 4), shrinkBelow(1.1), growAbove(2), window(w),
+    series(observables), tau(1), effectiveSamples(0)
+{ }
+
+bool AdaptivePeriod::addSample (const vguard<double>& obs) {
+  for (size_t n = 0; n < series.size(); ++n)
+    series[n].push_back (obs[n]);
+  if (series[0].size() < window)
+    return false;
+  tau = 1;
+  for (const auto& x: series)
+    tau = max (tau, autocorrelationTime (x));
+  effectiveSamples += window / tau;
+  for (auto& x: series)
+    x.clear();
+  const long oldPeriod = period;
+  if (tau < shrinkBelow)
+    period = max (minPeriod, period / 2);
+  else if (tau > growAbove)
+    period = min (maxPeriod, (long) ceil (period * tau));
+  return period != oldPeriod;
+}
+
+double AdaptivePeriod::effectiveSampleCount() const {
+  return effectiveSamples + series[0].size() / tau;
+}
+
+json AdaptivePeriod::report() const {
+  json j;
+  j["period"] = period;
+  j["tau"] = tau;
+  j["effectiveSamples"] = effectiveSampleCount();
+  return j;
+}
@@ -0,0 +1,75 @@
+#ifndef CONVERGE_INCLUDED
+#define CONVERGE_INCLUDED
+
+#include "cell.h"
+
+// time-series diagnostics
+double seriesMean (const vguard<double>&, size_t start = 0);
+double seriesVariance (const vguard<double>&, size_t start = 0);
+double autocorrelationTime (const vguard<double>&, size_t start = 0);  // integrated, with Sokal's adaptive window
+size_t equilibrationIndex (const vguard<double>&);  // MSER truncation point, at most halfway through the series
+double gelmanRubin (const vguard<double>& chainMeans, const vguard<double>& chainVars, double samplesPerChain);
+
+// Online convergence monitor for base-pairing probabilities across one or more replicas.
+// Pair samples are accumulated in batches (merged pairwise to bound memory), so burn-in can be
+// discarded batch-by-batch and standard errors computed by the method of batch means.
+struct ConvergenceMonitor {
+  typedef Board::IndexPair IndexPair;
+  typedef map<IndexPair,double> PairWeights;
+  struct Batch {
+    long firstSample, samples;
+    PairWeights weight;
+    Batch (long first) : firstSample(first), samples(0) { }
+  };
+
+  double precision;  // target standard error of every pair probability
+  double maxRhat;  // Gelman-Rubin threshold (only used with multiple replicas)
+  double minEss;  // minimum effective sample size of the energy series, per replica
+  size_t maxBatches, minBatches;
+  long batchSize;
+
+  vguard<vguard<double> > energy;  // per replica
+  vguard<vguard<Batch> > batch;  // per replica
+
+  // diagnostics from the last call to converged()
+  long burnIn;
+  vguard<double> tau, ess;
+  double pairStdErr, pairRhat;
+
+  ConvergenceMonitor (int replicas, double precision);
+
+  inline int replicas() const { return energy.size(); }
+  inline long samples() const { return energy[0].size(); }
+  void addSample (const vguard<double>& foldEnergy, const vguard<PairWeights>& pairWeights);  // one entry per replica
+  bool converged();  // re-evaluated whenever a batch is completed
+
+  PairWeights pairWeights() const;  // post-burn-in, pooled over replicas
+  long pairSamples() const;  // post-burn-in, pooled over replicas
+  json report() const;
+
+private:
+  size_t firstRetainedBatch() const;
+  void mergeBatches();
+};
+
+// Adaptive sampling period.
+// Observables are sampled in windows; at the end of each window the period is rescaled
+// to the largest integrated autocorrelation time (in moves), aiming for about one independent sample per period.
+// If samples already look independent, the period is halved to probe for oversampling.
+// Between the two thresholds the period is left alone, so noisy estimates of tau near 1 don't make it oscillate.
+struct AdaptivePeriod {
+  long period, minPeriod, maxPeriod;
+  double shrinkBelow, growAbove;  // tau thresholds for halving & rescaling the period
+  size_t window;  // samples per adaptation
+  vguard<vguard<double> > series;  // per observable, current window only
+  double tau;  // largest autocorrelation time in the last complete window, in samples
+  double effectiveSamples;  // accumulated over complete windows
+
+  AdaptivePeriod (long initialPeriod, int observables, size_t window = 64);
+
+  bool addSample (const vguard<double>& observables);  // returns true if the period changed
+  double effectiveSampleCount() const;  // including the current window
+  json report() const;
+};
+
+#endif /* CONVERGE_INCLUDED */
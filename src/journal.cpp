@@ -0,0 +1,231 @@
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include "journal.h"
+#include "profile.h"
+
+const char JournalHeader::magicString[] = "CARNAJNL";
+
+JournalWriter::JournalWriter (const string& filename, const Board& initial, long firstMove, bool resume, size_t maxPend)
+  : maxPending(max(maxPend,(size_t)1)), stopping(false), failed(false)
+{
+  if (resume)
+    truncateAfter (filename, initial, firstMove);
+  out.open (filename, resume ? (ios::binary | ios::app) : ios::binary);
+  if (!out)
+    throw runtime_error (string ("Can't write journal ") + filename);
+  if (!resume) {
+    JournalHeader h;
+    memset (&h, 0, sizeof(h));
+    memcpy (h.magic, JournalHeader::magicString, sizeof(h.magic));
+    h.version = JournalHeader::currentVersion;
+    h.byteOrder = BoardFileHeader::byteOrderMark;
+    h.headerSize = sizeof(h);
+    h.firstMove = firstMove;
+    h.boardBytes = binaryBoardSize (initial, false);
+    out.write ((const char*) &h, sizeof(h));
+    writeBinaryBoard (initial, out, false);
+  }
+  writer = thread (&JournalWriter::writerLoop, this);
+}
+
+void JournalWriter::truncateAfter (const string& filename, const Board& board, long move) {
+  uint64_t end;
+  {
+    JournalReader reader (filename);
+    if (reader.initial.xSize != board.xSize || reader.initial.ySize != board.ySize || reader.initial.zSize != board.zSize
+	|| reader.initial.sequence() != board.sequence())
+      throw runtime_error (string ("Journal ") + filename + " is of a different board");
+    long covered = reader.firstMove;
+    end = reader.offset();
+    JournalBlockHeader b;
+    while (reader.nextBlock (b) && b.endMove <= move) {
+      covered = b.endMove;
+      end = reader.offset();
+    }
+    if (covered != move)
+      throw runtime_error (string ("Journal ") + filename + " has no block ending at move " + to_string (move) + ", so can't be resumed from there");
+  }
+  if (truncate (filename.c_str(), end) != 0)
+    throw runtime_error (string ("Can't truncate journal ") + filename);
+}
+
+JournalWriter::~JournalWriter() {
+  if (writer.joinable()) {
+    {
+      lock_guard<mutex> lock (mx);
+      stopping = true;
+    }
+    blockReady.notify_all();
+    writer.join();
+  }
+}
+
+void JournalWriter::submit (const JournalBlockHeader& header, vguard<unsigned char>& buffer) {
+  PhaseTimer timer (Profiler::Logging);
+  vguard<unsigned char> empty;
+  {
+    unique_lock<mutex> lock (mx);
+    blockWritten.wait (lock, [this] { return pending.size() < maxPending || failed; });
+    if (failed)
+      throw runtime_error ("Error writing journal");
+    pending.push_back (make_pair (header, vguard<unsigned char>()));
+    pending.back().second.swap (buffer);
+    if (!spare.empty()) {
+      empty.swap (spare.back());
+      spare.pop_back();
+    }
+  }
+  blockReady.notify_one();
+  // recycle a written buffer, keeping its capacity
+  empty.clear();
+  buffer.swap (empty);
+}
+
+void JournalWriter::sync() {
+  unique_lock<mutex> lock (mx);
+  blockWritten.wait (lock, [this] { return pending.empty() || failed; });
+  // the writer thread only touches the stream while a block is pending
+  if (failed || !out.flush())
+    throw runtime_error ("Error writing journal");
+}
+
+void JournalWriter::writerLoop() {
+  while (true) {
+    pair<JournalBlockHeader,vguard<unsigned char> > block;
+    {
+      unique_lock<mutex> lock (mx);
+      blockReady.wait (lock, [this] { return !pending.empty() || stopping; });
+      if (pending.empty())
+	return;
+      block.first = pending.front().first;
+      block.second.swap (pending.front().second);
+      // leave the block queued until it's written, so that pending.size() bounds memory
+    }
+    out.write ((const char*) &block.first, sizeof(block.first));
+    out.write ((const char*) block.second.data(), block.second.size());
+    {
+      lock_guard<mutex> lock (mx);
+      pending.pop_front();
+      if (!out)
+	failed = true;
+      spare.push_back (vguard<unsigned char>());
+      spare.back().swap (block.second);
+    }
+    blockWritten.notify_all();
+  }
+}
+
+void JournalWriter::finish() {
+  {
+    lock_guard<mutex> lock (mx);
+    stopping = true;
+  }
+  blockReady.notify_all();
+  if (writer.joinable())
+    writer.join();
+  out.close();
+  if (failed || !out)
+    throw runtime_error ("Error writing journal");
+}
+
+void MoveJournal::startBlock() {
+  // count from the start of the block, so that a journal resumed at a block boundary is encoded as if never interrupted
+  lastEventMove = move;
+  block.baseMove = move;
+  block.endMove = move;
+  block.events = 0;
+  block.bytes = 0;
+  buffer.clear();
+}
+
+void MoveJournal::flush() {
+  block.endMove = move;
+  block.bytes = buffer.size();
+  writer->submit (block, buffer);
+  startBlock();
+}
+
+static inline uint64_t getVarint (const unsigned char*& p, const unsigned char* end) {
+  uint64_t n = 0;
+  for (int shift = 0; p < end; shift += 7) {
+    const unsigned char c = *p++;
+    n |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return n;
+  }
+  throw runtime_error ("Journal block is truncated");
+}
+
+JournalReader::JournalReader (const string& filename)
+  : file (filename), blockEvents(0), havePending(false), ended(false)
+{
+  JournalHeader h;
+  if (file.size < sizeof(h))
+    throw runtime_error ("Journal file is truncated");
+  memcpy (&h, file.data, sizeof(h));
+  if (memcmp (h.magic, JournalHeader::magicString, sizeof(h.magic)) != 0)
+    throw runtime_error ("Not a journal file");
+  if (h.byteOrder != BoardFileHeader::byteOrderMark)
+    throw runtime_error ("Journal file has the wrong byte order for this machine");
+  if (h.version > JournalHeader::currentVersion || h.headerSize < sizeof(h) || file.size < h.headerSize + h.boardBytes)
+    throw runtime_error ("Unsupported journal file version");
+  initial = readBinaryBoard (file.data + h.headerSize, h.boardBytes);
+  firstMove = endMove = lastEventMove = h.firstMove;
+  p = blockEnd = (const unsigned char*) file.data + h.headerSize + h.boardBytes;
+}
+
+bool JournalReader::next (JournalEvent& e) {
+  if (havePending) {
+    e = pendingEvent;
+    havePending = false;
+    return true;
+  }
+  JournalBlockHeader b;
+  while (blockEvents == 0)
+    if (!nextBlock (b))
+      return false;
+  e.move = lastEventMove + (long) getVarint (p, blockEnd);
+  e.unit = getVarint (p, blockEnd);
+  if (p >= blockEnd)
+    throw runtime_error ("Journal block is truncated");
+  e.dir = *p >> 3;
+  e.type = (MoveType) (*p & 7);
+  ++p;
+  lastEventMove = e.move;
+  --blockEvents;
+  return true;
+}
+
+bool JournalReader::nextBlock (JournalBlockHeader& b) {
+  const unsigned char* end = (const unsigned char*) file.data + file.size;
+  p = blockEnd;
+  bool complete = p + sizeof(b) <= end;
+  if (complete) {
+    memcpy (&b, p, sizeof(b));
+    complete = p + sizeof(b) + b.bytes <= end;
+  }
+  if (!complete) {
+    ended = true;  // at the end, or at a partial block from an unfinished run
+    return false;
+  }
+  p += sizeof(b);
+  blockEnd = p + b.bytes;
+  blockEvents = b.events;
+  lastEventMove = b.baseMove;
+  endMove = b.endMove;
+  return true;
+}
+
+void JournalReader::replayTo (Board& board, long move) {
+  NullMoveEvents events;
+  JournalEvent e;
+  while (next (e)) {
+    if (e.move > move) {
+      pendingEvent = e;
+      havePending = true;
+      return;
+    }
+    board.replayMove (e.unit, e.dir, e.type, events);
+  }
+}
@@ -0,0 +1,118 @@
+#ifndef JOURNAL_INCLUDED
+#define JOURNAL_INCLUDED
+
+#include <cstdint>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "cell.h"
+#include "boardfile.h"
+
+// Move journals: every move a Board accepts, in a few bytes, for exact replay & offline analysis.
+// Layout (native byte order):
+//   JournalHeader, then the initial Board in binary board format (boardBytes long)
+//   blocks, each a JournalBlockHeader followed by its events
+// An event is a varint count of moves since the previous event (or since the block's baseMove),
+// a varint unit index, and a byte holding the direction (index into Board::neighborhood) << 3 | the MoveType.
+// Replaying the events with Board::replayMove from the initial Board reproduces the run's states exactly.
+
+struct JournalHeader {
+  char magic[8];  // "CARNAJNL"
+  uint32_t version, byteOrder, headerSize, reserved;
+  int64_t firstMove;  // move number of the initial Board
+  uint64_t boardBytes;
+  static const char magicString[];
+  static const uint32_t currentVersion = 1;
+};
+
+struct JournalBlockHeader {
+  int64_t baseMove, endMove;  // events are counted from baseMove; the block covers moves up to endMove
+  uint32_t events, bytes;
+};
+
+struct JournalEvent {
+  long move;
+  int unit, dir;
+  MoveType type;
+};
+
+// Writes blocks of encoded events to the journal file from a background thread
+class JournalWriter {
+public:
+  // With resume, an existing journal of the same board (initial is then the current Board) is continued from firstMove:
+  // blocks after it are discarded, and new ones appended. It must have a block ending at firstMove (see sync).
+  JournalWriter (const string& filename, const Board& initial, long firstMove = 0, bool resume = false, size_t maxPending = 8);
+  ~JournalWriter();
+  // hand over a block; the buffer is swapped for an empty one (waits if too many blocks are pending)
+  void submit (const JournalBlockHeader& header, vguard<unsigned char>& buffer);
+  void sync();  // wait until every submitted block is written & flushed, e.g. before checkpointing
+  void finish();  // write any pending blocks and stop the thread
+private:
+  ofstream out;
+  size_t maxPending;
+  deque<pair<JournalBlockHeader,vguard<unsigned char> > > pending;
+  vguard<vguard<unsigned char> > spare;
+  thread writer;
+  mutex mx;
+  condition_variable blockReady, blockWritten;
+  bool stopping, failed;
+  void writerLoop();
+  static void truncateAfter (const string& filename, const Board& board, long move);
+};
+
+// Event hooks that count outcomes and journal every accepted move.
+// Events are encoded into the current block, which goes to the JournalWriter when it reaches blockBytes.
+struct MoveJournal : MoveCounter {
+  JournalWriter* writer;
+  long move, lastEventMove;
+  size_t blockBytes;
+  JournalBlockHeader block;
+  vguard<unsigned char> buffer;
+  MoveJournal (JournalWriter* w = NULL, long firstMove = 0, size_t bytes = 1 << 20)
+    : writer(w), move(firstMove), lastEventMove(firstMove), blockBytes(bytes)
+  { startBlock(); }
+  inline void nextMove() { ++move; }
+  inline void moved (int i, int dir, MoveType t) {
+    putVarint (move - lastEventMove);
+    putVarint (i);
+    buffer.push_back ((unsigned char) ((dir << 3) | t));
+    lastEventMove = move;
+    ++block.events;
+    if (buffer.size() >= blockBytes)
+      flush();
+  }
+  void flush();  // submit the current block, even if it is empty or partial
+private:
+  inline void putVarint (uint64_t n) {
+    while (n >= 0x80) {
+      buffer.push_back ((unsigned char) (n | 0x80));
+      n >>= 7;
+    }
+    buffer.push_back ((unsigned char) n);
+  }
+  void startBlock();
+};
+
+// Reads a journal through mmap, one event at a time
+class JournalReader {
+public:
+  JournalReader (const string& filename);
+  Board initial;
+  long firstMove, endMove;  // endMove: moves covered by the blocks read so far
+  bool next (JournalEvent&);  // false at the end of the journal
+  bool nextBlock (JournalBlockHeader&);  // skip to the next complete block, before reading its events; false at the end
+  uint64_t offset() const { return blockEnd - (const unsigned char*) file.data; }  // end of the current block
+  bool finished() const { return ended; }  // true once every event has been read; endMove is then final
+  void replayTo (Board& board, long move);  // apply events up to and including the given move
+private:
+  MappedFile file;
+  const unsigned char *p, *blockEnd;
+  long lastEventMove;
+  uint32_t blockEvents;
+  bool havePending, ended;
+  JournalEvent pendingEvent;
+};
+
+#endif /* JOURNAL_INCLUDED */
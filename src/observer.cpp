@@ -0,0 +1,377 @@
+#include <limits>
+#include <unordered_map>
+#include <set>
+#include "observer.h"
+
+map<string,ObservableFactory>& observableRegistry() {
+  static map<string,ObservableFactory> registry;
+  return registry;
+}
+
+bool registerObservable (const string& name, ObservableFactory factory) {
+  observableRegistry()[name] = factory;
+  return true;
+}
+
+bool registerObservable (const string& name, function<Observable*(long period)> factory) {
+  return registerObservable (name, [name, factory] (long period, const string& arg) {
+      if (!arg.empty())
+	throw runtime_error (string ("Observable ") + name + " takes no argument");
+      return factory (period);
+    });
+}
+
+void ObserverSet::add (const string& spec) {
+  const size_t colon = spec.find (':'), equals = spec.find ('=');
+  const string name = spec.substr (0, min (colon, equals));
+  const string arg = equals < colon ? spec.substr (equals + 1, colon == string::npos ? string::npos : colon - equals - 1) : string();
+  const auto iter = observableRegistry().find (name);
+  if (iter == observableRegistry().end())
+    throw runtime_error (string ("Unknown observable: ") + name);
+  const long period = colon == string::npos ? 0 : stol (spec.substr (colon + 1));
+  observable.push_back (unique_ptr<Observable> (iter->second (period, arg)));
+  if (observable.back()->period <= 0)
+    throw runtime_error (string ("Observable period must be positive: ") + spec);
+  due.push_back (0);
+}
+
+bool ObserverSet::wantsEvents() const {
+  for (const auto& obs: observable)
+    if (obs->needsEvents())
+      return true;
+  return false;
+}
+
+long ObserverSet::nextDue() const {
+  long next = numeric_limits<long>::max();
+  for (long d: due)
+    next = min (next, d);
+  return next;
+}
+
+void ObserverSet::dispatch (const Board& board, long move) {
+  // all incremental observables share one event log, drained whenever any of them is due
+  bool drain = false;
+  for (size_t n = 0; n < observable.size(); ++n)
+    if (due[n] <= move && (observable[n]->needsEvents()))
+      drain = true;
+  // observables needing events see them all, then get a snapshot pass when due (after the events, so the two agree)
+  for (size_t n = 0; n < observable.size(); ++n) {
+    Observable& obs = *observable[n];
+    if (drain && (obs.needsEvents()))
+      obs.observeEvents (board, events.event);
+    if (due[n] <= move) {
+      obs.observe (board, move);
+      due[n] = move + obs.period;
+    }
+  }
+  if (drain)
+    events.event.clear();
+}
+
+void ObserverSet::finish (const Board& board, long move) {
+  if (events.event.empty())
+    return;
+  for (const auto& obs: observable)
+    if (obs->needsEvents())
+      obs->observeEvents (board, events.event);
+  events.event.clear();
+}
+
+json ObserverSet::report() const {
+  json j = json::object();
+  for (const auto& obs: observable)
+    j[obs->name] = obs->report();
+  return j;
+}
+
+// Built-in observables
+
+// contacts: frequency with which two Units (neither bonded nor basepaired) occupy adjacent cells
+struct ContactMap : Observable {
+  map<Board::IndexPair,long> count;
+  long samples;
+  ContactMap (long p) : Observable ("contacts", p ? p : 1000), samples(0) { }
+  void observe (const Board& board, long move) {
+    for (const Unit& u: board.unit)
+      for (const Vec& d: board.neighborhood)
+	for (int rev = 0; rev <= 1; ++rev) {
+	  const int j = board.cell (u.pos + d, rev);
+	  if (j > u.index && j != u.next && j != u.prev)
+	    ++count[Board::IndexPair (u.index, j)];
+	}
+    ++samples;
+  }
+  json report() const {
+    json j;
+    j["samples"] = samples;
+    for (const auto& ij_n: count)
+      j["freq"][to_string(ij_n.first.first)][to_string(ij_n.first.second)] = ((double) ij_n.second) / samples;
+    return j;
+  }
+};
+
+// loops: histogram of hairpin loop lengths (unpaired Units enclosed by a basepair within one strand)
+struct LoopHistogram : Observable {
+  map<int,long> count;
+  long samples;
+  LoopHistogram (long p) : Observable ("loops", p ? p : 1000), samples(0) { }
+  void observe (const Board& board, long move) {
+    for (const auto& ij: board.pairList()) {
+      int len = 0, k = board.unit[ij.first].next;
+      while (k >= 0 && k != ij.second && !board.isPaired (board.unit[k])) {
+	++len;
+	k = board.unit[k].next;
+      }
+      if (k == ij.second)
+	++count[len];
+    }
+    ++samples;
+  }
+  json report() const {
+    json j;
+    j["samples"] = samples;
+    for (const auto& len_n: count)
+      j["freq"][to_string(len_n.first)] = ((double) len_n.second) / samples;
+    return j;
+  }
+};
+
+// strands: histogram of strand lengths (cyclic strands are counted separately)
+struct StrandHistogram : Observable {
+  map<int,long> linear, cyclic;
+  long samples;
+  StrandHistogram (long p) : Observable ("strands", p ? p : 1000), samples(0) { }
+  void observe (const Board& board, long move) {
+    vguard<bool> seen (board.unit.size());
+    for (const Unit& head: board.unit)
+      if (head.prev < 0) {
+	int len = 0;
+	for (int k = head.index; k >= 0; k = board.unit[k].next) {
+	  seen[k] = true;
+	  ++len;
+	}
+	++linear[len];
+      }
+    for (const Unit& start: board.unit)
+      if (!seen[start.index]) {
+	int len = 0;
+	for (int k = start.index; !seen[k]; k = board.unit[k].next) {
+	  seen[k] = true;
+	  ++len;
+	}
+	++cyclic[len];
+      }
+    ++samples;
+  }
+  json report() const {
+    json j;
+    j["samples"] = samples;
+    for (const auto& len_n: linear)
+      j["linear"][to_string(len_n.first)] = ((double) len_n.second) / samples;
+    for (const auto& len_n: cyclic)
+      j["cyclic"][to_string(len_n.first)] = ((double) len_n.second) / samples;
+    return j;
+  }
+};
+
+// pair-events: counts of accepted moves by type, basepair formation & breakage, ligations, and mean basepair lifetime
+struct PairEvents : Observable {
+  vguard<long> moves;
+  long formed, broken, ligated, lifetimes;
+  double totalLifetime;
+  map<Board::IndexPair,long> formedAt;
+  PairEvents (long p)
+    : Observable ("pair-events", p ? p : 100000),
+      moves(MoveTypes), formed(0), broken(0), ligated(0), lifetimes(0), totalLifetime(0)
+  { }
+  bool needsEvents() const { return true; }
+  static inline Board::IndexPair key (int i, int j) { return Board::IndexPair (min(i,j), max(i,j)); }
+  void observeEvents (const Board& board, const vguard<MoveEvent>& events) {
+    for (const auto& e: events)
+      switch (e.kind) {
+      case MoveEvent::Moved: ++moves[e.type]; break;
+      case MoveEvent::Paired: ++formed; formedAt[key(e.i,e.j)] = e.move; break;
+      case MoveEvent::Ligated: ++ligated; break;
+      case MoveEvent::Unpaired:
+	{
+	  ++broken;
+	  const auto iter = formedAt.find (key(e.i,e.j));
+	  if (iter != formedAt.end()) {
+	    totalLifetime += e.move - iter->second;
+	    ++lifetimes;
+	    formedAt.erase (iter);
+	  }
+	}
+	break;
+      default: break;
+      }
+  }
+  json report() const {
+    const char* typeName[] = { "none", "free", "paired", "split", "splitMerge", "merge", "ligation" };
+    json j;
+    for (int t = 1; t < MoveTypes; ++t)
+      j["moves"][typeName[t]] = moves[t];
+    j["formed"] = formed;
+    j["broken"] = broken;
+    j["ligated"] = ligated;
+    if (lifetimes)
+      j["meanLifetime"] = totalLifetime / lifetimes;
+    return j;
+  }
+};
+
+// strand-pairs: basepairing of selected strands, at positions along the strand rather than board indices.
+// With no argument, tracks the template: the Units of the strand holding Unit 0 (the --init sequence) when first observed,
+// even if other Units later ligate to it. With a sequence argument, tracks every linear strand with exactly that sequence.
+// Pairs within a strand, pairs to other strands (by the partner's position along its own strand) and pairs to free monomers
+// are counted separately, as frequencies per tracked strand. Each pass costs time proportional to the tracked strands
+// (and the strands paired to them). Matching strands are found by one scan of the board, then kept up to date from
+// ligation events, re-checking only the strand each ligation extended.
+struct StrandPairs : Observable {
+  vguard<int> seq;  // bases to match; empty to track the template
+  string sequence;
+  vguard<int> templateUnits;
+  set<int> heads;  // first Units of the matching strands
+  bool scanned;
+  long samples, strandSamples;
+  map<Board::IndexPair,long> intra, inter;
+  map<int,long> monomer;
+  vguard<int> strand;
+  unordered_map<int,int> strandPos, partnerPos;
+
+  StrandPairs (long p, const string& arg)
+    : Observable (arg.empty() ? string("strand-pairs") : ("strand-pairs=" + arg), p ? p : 1000),
+      scanned(false), samples(0), strandSamples(0)
+  {
+    for (char c: arg) {
+      sequence += tolower (c);
+      if (!Unit::isRNA (sequence.back()))
+	throw runtime_error (string ("Observable strand-pairs needs an RNA sequence, not ") + arg);
+      seq.push_back (Unit::char2base (sequence.back()));
+    }
+  }
+  bool needsEvents() const { return !seq.empty(); }  // ligations, to keep the matching strands up to date
+
+  // position of a Unit along its strand, counted from the 5' end (or from the Unit itself, for a cyclic strand)
+  int positionInStrand (const Board& board, int j) {
+    const auto iter = partnerPos.find (j);
+    if (iter != partnerPos.end())
+      return iter->second;
+    int head = j;
+    while (board.unit[head].prev >= 0 && board.unit[head].prev != j)
+      head = board.unit[head].prev;
+    if (board.unit[head].prev >= 0)
+      head = j;
+    int pos = 0;
+    for (int k = head; k >= 0 && (pos == 0 || k != head); k = board.unit[k].next)
+      partnerPos[k] = pos++;
+    return partnerPos[j];
+  }
+
+  bool matches (const Board& board, int head) const {
+    size_t len = 0;
+    int k = head;
+    for (; k >= 0 && len < seq.size() && board.unit[k].base == seq[len]; k = board.unit[k].next)
+      ++len;
+    return board.unit[head].prev < 0 && k < 0 && len == seq.size();
+  }
+
+  void findStrands (const Board& board) {
+    heads.clear();
+    for (const Unit& head: board.unit)
+      if (head.prev < 0 && head.base == seq[0] && matches (board, head.index))
+	heads.insert (head.index);
+    scanned = true;
+  }
+
+  // ligation only ever joins strands: j is no longer a head, and the strand now holding i may have started or stopped matching
+  void observeEvents (const Board& board, const vguard<MoveEvent>& events) {
+    if (!scanned) {
+      findStrands (board);
+      return;
+    }
+    for (const auto& e: events)
+      if (e.kind == MoveEvent::Ligated) {
+	heads.erase (e.j);
+	int head = e.i;
+	while (board.unit[head].prev >= 0 && board.unit[head].prev != e.i)
+	  head = board.unit[head].prev;
+	if (board.unit[head].prev < 0) {
+	  heads.erase (head);
+	  if (matches (board, head))
+	    heads.insert (head);
+	}
+      }
+  }
+
+  void observeStrand (const Board& board) {
+    strandPos.clear();
+    for (size_t p = 0; p < strand.size(); ++p)
+      strandPos[strand[p]] = p;
+    for (size_t p = 0; p < strand.size(); ++p) {
+      const int j = board.pairedIndex (board.unit[strand[p]]);
+      if (j < 0)
+	continue;
+      const auto iter = strandPos.find (j);
+      if (iter != strandPos.end()) {
+	if (iter->second > (int) p)
+	  ++intra[Board::IndexPair (p, iter->second)];
+      } else if (board.unit[j].prev < 0 && board.unit[j].next < 0)
+	++monomer[p];
+      else
+	++inter[Board::IndexPair (p, positionInStrand (board, j))];
+    }
+    ++strandSamples;
+  }
+
+  void observe (const Board& board, long move) {
+    partnerPos.clear();
+    if (seq.empty()) {
+      if (templateUnits.empty() && !board.unit.empty()) {
+	int head = 0;
+	while (board.unit[head].prev >= 0 && board.unit[head].prev != 0)
+	  head = board.unit[head].prev;
+	for (int k = head; k >= 0 && (templateUnits.empty() || k != head); k = board.unit[k].next) {
+	  templateUnits.push_back (k);
+	  sequence += board.unit[k].baseChar();
+	}
+      }
+      strand = templateUnits;
+      if (!strand.empty())
+	observeStrand (board);
+    } else {
+      if (!scanned)
+	findStrands (board);
+      for (int head: heads) {
+	strand.clear();
+	for (int k = head; k >= 0; k = board.unit[k].next)
+	  strand.push_back (k);
+	observeStrand (board);
+      }
+    }
+    ++samples;
+  }
+
+  json report() const {
+    json j;
+    j["samples"] = samples;
+    j["strands"] = samples ? ((double) strandSamples / samples) : 0.;  // mean number tracked per sample
+    j["sequence"] = sequence;
+    const double n = max (strandSamples, 1L);
+    for (const auto& ij_n: intra)
+      j["prob"][to_string(ij_n.first.first)][to_string(ij_n.first.second)] = ij_n.second / n;
+    for (const auto& ij_n: inter)
+      j["inter"][to_string(ij_n.first.first)][to_string(ij_n.first.second)] = ij_n.second / n;
+    for (const auto& i_n: monomer)
+      j["monomer"][to_string(i_n.first)] = i_n.second / n;
+    return j;
+  }
+};
+
+static const bool builtinsRegistered =
+  registerObservable ("contacts", [] (long p) { return new ContactMap (p); })
+  && registerObservable ("loops", [] (long p) { return new LoopHistogram (p); })
+  && registerObservable ("strands", [] (long p) { return new StrandHistogram (p); })
+  && registerObservable ("pair-events", [] (long p) { return new PairEvents (p); })
+  && registerObservable ("strand-pairs", [] (long p, const string& arg) { return new StrandPairs (p, arg); });
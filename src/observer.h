@@ -0,0 +1,47 @@
+#ifndef OBSERVER_INCLUDED
+#define OBSERVER_INCLUDED
+
+#include <memory>
+#include <functional>
+#include "cell.h"
+
+// An Observable is a named statistic accumulated over a run.
+// It declares how often (in moves) it wants a snapshot pass;
+// observables that need events also receive every move event, in batches, before any snapshot pass that is due.
+// Observables are only ever called between blocks of moves, never from inside tryMove.
+struct Observable {
+  string name;
+  long period;
+
+  Observable (const string& n, long p) : name(n), period(p) { }
+  virtual ~Observable() { }
+
+  virtual bool needsEvents() const { return false; }
+  virtual void observe (const Board&, long move) { }  // snapshot pass
+  virtual void observeEvents (const Board&, const vguard<MoveEvent>&) { }  // incremental pass
+  virtual json report() const = 0;
+};
+
+// Factories receive the period (0 for the default) and the argument, if any, from a spec "name=ARG:period"
+typedef function<Observable*(long period, const string& arg)> ObservableFactory;
+map<string,ObservableFactory>& observableRegistry();
+bool registerObservable (const string& name, ObservableFactory factory);
+bool registerObservable (const string& name, function<Observable*(long period)> factory);  // for observables taking no argument
+
+// The observables active in a run.
+// If none of them needs events, the stepping loop can use the event-free tryMove.
+struct ObserverSet {
+  vector<unique_ptr<Observable> > observable;
+  vguard<long> due;  // move number of next pass, per observable
+  MoveEventLog events;
+
+  void add (const string& spec);  // "name", "name:period", "name=arg" or "name=arg:period"
+  inline bool empty() const { return observable.empty(); }
+  bool wantsEvents() const;
+  long nextDue() const;  // earliest move number at which some observable wants to be called
+  void dispatch (const Board&, long move);  // call observables that are due at this move
+  void finish (const Board&, long move);  // at the end of a run, hand any events not yet dispatched to the incremental observables
+  json report() const;
+};
+
+#endif /* OBSERVER_INCLUDED */
@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include "pairmatrix.h"
+#include "util.h"
+
+void writePairCsv (const Board& board, const PairCountMap& pairCount, double samples, ostream& out) {
+  const size_t n = board.unit.size();
+  out << "*," << join (board.sequence(), ",") << endl;
+  auto ij_n = pairCount.begin();
+  string row;
+  for (size_t i = 0; i < n; ++i) {
+    row.clear();
+    row += board.unit[i].baseChar();
+    row += ',';
+    size_t col = 0;
+    for (; ij_n != pairCount.end() && ij_n->first.first == (int) i; ++ij_n) {
+      row.append (ij_n->first.second - col, ',');
+      row += to_string (ij_n->second / samples);
+      col = ij_n->first.second;
+    }
+    if (n > 0)
+      row.append (n - 1 - col, ',');
+    out << row << '\n';
+  }
+  out.flush();
+}
+
+void writePairCoo (const PairCountMap& pairCount, double samples, ostream& out) {
+  out << "i,j,prob\n";
+  for (const auto& ij_n: pairCount)
+    out << ij_n.first.first << ',' << ij_n.first.second << ',' << to_string (ij_n.second / samples) << '\n';
+  out.flush();
+}
+
+void writePairNpy (const PairCountMap& pairCount, double samples, size_t units, ostream& out) {
+  const uint16_t one = 1;
+  const bool littleEndian = *(const char*) &one;
+  string header = string ("{'descr': '") + (littleEndian ? '<' : '>') + "f4', 'fortran_order': False, 'shape': ("
+    + to_string(units) + ", " + to_string(units) + "), }";
+  // magic, version 1.0 & header length take 10 bytes; pad the header so the data is 64-byte aligned
+  header.append (63 - (10 + header.size()) % 64, ' ');
+  header += '\n';
+  const uint16_t headerSize = header.size();
+  out.write ("\x93NUMPY\x01\x00", 8);
+  out.put ((char) (headerSize & 0xff));
+  out.put ((char) (headerSize >> 8));
+  out << header;
+  vguard<float> row (units);
+  auto ij_n = pairCount.begin();
+  for (size_t i = 0; i < units; ++i) {
+    fill (row.begin(), row.end(), 0.f);
+    for (; ij_n != pairCount.end() && ij_n->first.first == (int) i; ++ij_n)
+      row[ij_n->first.second] = ij_n->second / samples;
+    out.write ((const char*) row.data(), row.size() * sizeof(float));
+  }
+  out.flush();
+}
+
+// little-endian header fields
+static void putLE (string& s, uint32_t n, int bytes) {
+  for (int b = 0; b < bytes; ++b, n >>= 8)
+    s += (char) (n & 0xff);
+}
+
+void writePairBitmap (const PairCountMap& pairCount, double samples, size_t units, ostream& out, size_t maxSize) {
+  const size_t scale = (maxSize > 0 && units > maxSize) ? (units + maxSize - 1) / maxSize : 1;
+  const size_t size = (units + scale - 1) / scale;
+  const size_t rowBytes = (3 * size + 3) & ~(size_t) 3;
+  if (rowBytes * size + 54 > 0xffffffffUL)
+    throw runtime_error ("Bitmap is too big for the BMP format; limit its size");
+
+  // pixels as (row, column, level), sorted so rows can be written bottom-up
+  struct Pixel { size_t row, col; int level; };
+  vguard<Pixel> pixel;
+  pixel.reserve (pairCount.size());
+  for (const auto& ij_n: pairCount)
+    pixel.push_back (Pixel { ij_n.first.second / scale, ij_n.first.first / scale, (int) (255.0 * ij_n.second / samples + .5) });
+  sort (pixel.begin(), pixel.end(), [] (const Pixel& a, const Pixel& b) {
+      return a.row != b.row ? a.row > b.row : a.col < b.col;
+    });
+
+  string header;
+  putLE (header, 19778, 2);  // "BM"
+  putLE (header, 54 + rowBytes * size, 4);
+  putLE (header, 0, 4);
+  putLE (header, 54, 4);  // offset of the pixels
+  putLE (header, 40, 4);  // information header size
+  putLE (header, size, 4);
+  putLE (header, size, 4);
+  putLE (header, 1, 2);  // planes
+  putLE (header, 24, 2);  // bits per pixel
+  putLE (header, 0, 4);  // no compression
+  putLE (header, rowBytes * size, 4);
+  putLE (header, 0, 4);
+  putLE (header, 0, 4);
+  putLE (header, 0, 4);
+  putLE (header, 0, 4);
+  out << header;
+
+  vguard<unsigned char> row (rowBytes);
+  auto p = pixel.begin();
+  for (size_t r = size; r-- > 0; ) {
+    fill (row.begin(), row.end(), 0);
+    for (; p != pixel.end() && p->row == r; ++p) {
+      unsigned char* rgb = row.data() + 3 * p->col;
+      const unsigned char level = max ((int) rgb[0], min (p->level, 255));
+      rgb[0] = rgb[1] = rgb[2] = level;
+    }
+    out.write ((const char*) row.data(), rowBytes);
+  }
+  out.flush();
+}
@@ -0,0 +1,26 @@
+#ifndef PAIRMATRIX_INCLUDED
+#define PAIRMATRIX_INCLUDED
+
+#include <iostream>
+#include "cell.h"
+
+// Export of base-pairing probabilities, i.e. basepair counts divided by the number of samples.
+// The counts are sparse, so every writer streams its output a row at a time,
+// in memory proportional to the number of counted pairs (plus one row), never the whole N*N matrix.
+typedef map<Board::IndexPair,double> PairCountMap;
+
+// dense CSV, headed by the sequence, with blank cells for unpaired positions
+void writePairCsv (const Board& board, const PairCountMap& pairCount, double samples, ostream& out);
+
+// sparse coordinate list: a header line "i,j,prob", then one line per counted pair
+void writePairCoo (const PairCountMap& pairCount, double samples, ostream& out);
+
+// dense N*N float32 matrix in NumPy .npy format (readable with numpy.load)
+void writePairNpy (const PairCountMap& pairCount, double samples, size_t units, ostream& out);
+
+// 24-bit grayscale BMP, pair (i,j) at column i & row j.
+// If maxSize is nonzero and smaller than units, blocks of positions are merged into one pixel,
+// showing the highest probability in the block, so that the image is at most maxSize pixels across.
+void writePairBitmap (const PairCountMap& pairCount, double samples, size_t units, ostream& out, size_t maxSize = 0);
+
+#endif /* PAIRMATRIX_INCLUDED */
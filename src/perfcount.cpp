@@ -0,0 +1,122 @@
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "perfcount.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+const char* PerfCounters::counterName[] = { "cycles", "instructions", "l1dMisses", "llcMisses", "branchMisses" };
+
+#ifdef __linux__
+// the first counter opened leads the group; the others are scheduled with it, and start & stop with it
+static int openCounter (unsigned type, unsigned long long config, int leader) {
+  perf_event_attr attr;
+  memset (&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = leader < 0;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall (__NR_perf_event_open, &attr, 0, -1, leader, 0);
+}
+#endif
+
+PerfCounters::PerfCounters() {
+  fill (fd, fd + Counters, -1);
+  fill (value, value + Counters, 0);
+#ifdef __linux__
+  const unsigned type[] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+  const unsigned long long config[] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+  };
+  for (int c = 0; c < Counters; ++c) {
+    fd[c] = openCounter (type[c], config[c], leader());
+    if (fd[c] < 0 && unavailable.empty())
+      unavailable = string ("perf_event_open failed for ") + counterName[c] + ": " + strerror (errno);
+  }
+#else
+  unavailable = "hardware counters are only supported on Linux";
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+  for (int c = 0; c < Counters; ++c)
+    if (fd[c] >= 0)
+      close (fd[c]);
+#endif
+}
+
+int PerfCounters::leader() const {
+  for (int c = 0; c < Counters; ++c)
+    if (fd[c] >= 0)
+      return fd[c];
+  return -1;
+}
+
+bool PerfCounters::available() const {
+  return leader() >= 0;
+}
+
+void PerfCounters::start() {
+#ifdef __linux__
+  if (leader() >= 0) {
+    ioctl (leader(), PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl (leader(), PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#endif
+}
+
+void PerfCounters::stop() {
+#ifdef __linux__
+  if (leader() < 0)
+    return;
+  ioctl (leader(), PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  // group read: number of counters, time enabled & running, then the counts in the order the counters were opened
+  uint64_t data[3 + Counters];
+  const ssize_t bytes = read (leader(), data, sizeof(data));
+  if (bytes < (ssize_t) (3 * sizeof(uint64_t)) || bytes < (ssize_t) ((3 + data[0]) * sizeof(uint64_t)))
+    return;
+  const uint64_t enabled = data[1], running = data[2];
+  if (running == 0) {  // never scheduled, e.g. the PMU couldn't fit the whole group
+    if (enabled > 0 && unavailable.empty())
+      unavailable = "counter group was never scheduled";
+    return;
+  }
+  // if the kernel multiplexed the group with other events, extrapolate to the whole time it was enabled
+  const double scale = (double) enabled / running;
+  uint64_t n = 0;
+  for (int c = 0; c < Counters && n < data[0]; ++c)
+    if (fd[c] >= 0)
+      value[c] += llround (data[3 + n++] * scale);
+#endif
+}
+
+void PerfCounters::reset() {
+  fill (value, value + Counters, 0);
+}
+
+json PerfCounters::report (double perUnit) const {
+  json j = json::object();
+  for (int c = 0; c < Counters; ++c)
+    if (fd[c] >= 0)
+      j[counterName[c]] = value[c] / perUnit;
+  if (fd[Cycles] >= 0 && fd[Instructions] >= 0 && value[Cycles] > 0)
+    j["ipc"] = ((double) value[Instructions]) / value[Cycles];
+  if (!unavailable.empty())
+    j["unavailable"] = unavailable;
+  return j;
+}
@@ -0,0 +1,40 @@
+#ifndef PERFCOUNT_INCLUDED
+#define PERFCOUNT_INCLUDED
+
+#include <string>
+#include "json.hpp"
+
+using namespace std;
+using json = nlohmann::json;
+
+// Hardware performance counters for the calling thread, via Linux perf_event_open.
+// The counters are opened as one group, so they count over exactly the same intervals, and are scaled up
+// if the kernel had to multiplex them with other events.
+// Counters that can't be opened (no kernel support, perf_event_paranoid, containers, other OS)
+// are simply left out of the report; the reason is kept in unavailable.
+class PerfCounters {
+public:
+  enum Counter { Cycles, Instructions, L1DMisses, LLCMisses, BranchMisses, Counters };
+  static const char* counterName[];
+
+  PerfCounters();
+  ~PerfCounters();
+
+  bool available() const;  // true if any counter could be opened
+  void start();  // resume counting
+  void stop();  // pause counting and accumulate
+  void reset();
+  long long count (Counter c) const { return value[c]; }
+  json report (double perUnit = 1) const;  // counts divided by perUnit (e.g. number of moves), plus IPC
+
+  string unavailable;
+
+private:
+  int fd[Counters];
+  long long value[Counters];
+  int leader() const;  // file descriptor of the group leader, or -1 if no counter could be opened
+  PerfCounters (const PerfCounters&) = delete;
+  PerfCounters& operator= (const PerfCounters&) = delete;
+};
+
+#endif /* PERFCOUNT_INCLUDED */
@@ -0,0 +1,83 @@
+#include <sstream>
+#include "pipeline.h"
+#include "profile.h"
+
+LogPipeline::LogPipeline (Formatter f, ostream& o, int threads, size_t slots, bool cells)
+  : format(f), out(o), copyCells(cells), slot(threads > 0 ? slots : 1),
+    nextSubmit(0), nextFormat(0), nextWrite(0), stopping(false)
+{
+  for (int t = 0; t < threads; ++t)
+    worker.push_back (thread (&LogPipeline::workerLoop, this));
+}
+
+LogPipeline::~LogPipeline() {
+  finish();
+}
+
+void LogPipeline::submit (const Board& board, const LogRecord& record) {
+  PhaseTimer timer (Profiler::Logging);
+  if (worker.empty()) {
+    PhaseTimer formatTimer (Profiler::Formatting);
+    format (board, record, out);
+    return;
+  }
+  Slot* s;
+  {
+    unique_lock<mutex> lock (mx);
+    s = &slotFor (nextSubmit);
+    slotFreed.wait (lock, [s] { return s->state == Free; });
+  }
+  // the slot is Free, so no worker will touch it until we mark it Pending
+  s->board.copyStateFrom (board, copyCells);
+  s->record = record;
+  {
+    lock_guard<mutex> lock (mx);
+    s->state = Pending;
+    ++nextSubmit;
+  }
+  workReady.notify_one();
+}
+
+void LogPipeline::workerLoop() {
+  ostringstream text;
+  while (true) {
+    Slot* s;
+    {
+      unique_lock<mutex> lock (mx);
+      workReady.wait (lock, [this] { return nextFormat < nextSubmit || stopping; });
+      if (nextFormat == nextSubmit)
+	return;
+      s = &slotFor (nextFormat++);
+      s->state = Busy;
+    }
+    {
+      PhaseTimer timer (Profiler::Formatting);
+      text.str (string());
+      format (s->board, s->record, text);
+      s->text = text.str();
+    }
+    {
+      lock_guard<mutex> lock (mx);
+      s->state = Done;
+      // write out whatever is next in order and ready
+      while (nextWrite < nextFormat && slotFor(nextWrite).state == Done) {
+	Slot& w = slotFor (nextWrite++);
+	out << w.text;
+	w.state = Free;
+      }
+    }
+    slotFreed.notify_all();
+  }
+}
+
+void LogPipeline::finish() {
+  {
+    lock_guard<mutex> lock (mx);
+    stopping = true;
+  }
+  workReady.notify_all();
+  for (auto& t: worker)
+    t.join();
+  worker.clear();
+  out.flush();
+}
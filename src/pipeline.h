@@ -0,0 +1,56 @@
+#ifndef PIPELINE_INCLUDED
+#define PIPELINE_INCLUDED
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "cell.h"
+
+// progress information accompanying a logged snapshot
+struct LogRecord {
+  long move, moves, succeeded;
+  LogRecord (long m = 0, long ms = 0, long s = 0) : move(m), moves(ms), succeeded(s) { }
+  inline double percent() const { return moves ? (100. * move / moves) : 0; }
+};
+
+// Asynchronous logging pipeline.
+// At each sample point the stepping thread copies the Board state into a ring of snapshot buffers
+// (reusing their storage), and returns straight away unless the ring is full.
+// Worker threads format snapshots; output is written strictly in submission order.
+// With zero threads, snapshots are formatted and written inline.
+class LogPipeline {
+public:
+  typedef function<void(const Board&,const LogRecord&,ostream&)> Formatter;
+
+  LogPipeline (Formatter format, ostream& out, int threads = 1, size_t slots = 16, bool copyCells = true);
+  ~LogPipeline();
+
+  void submit (const Board&, const LogRecord&);
+  void finish();  // drain the ring, stop the workers and flush
+
+private:
+  enum SlotState { Free, Pending, Busy, Done };
+  struct Slot {
+    Board board;
+    LogRecord record;
+    string text;
+    SlotState state;
+    Slot() : state(Free) { }
+  };
+
+  Formatter format;
+  ostream& out;
+  bool copyCells;
+  vguard<Slot> slot;
+  vguard<thread> worker;
+  mutex mx;
+  condition_variable slotFreed, workReady;
+  long nextSubmit, nextFormat, nextWrite;
+  bool stopping;
+
+  inline Slot& slotFor (long seq) { return slot[seq % slot.size()]; }
+  void workerLoop();
+};
+
+#endif /* PIPELINE_INCLUDED */
@@ -0,0 +1,82 @@
+#include <atomic>
+#include "profile.h"
+
+const char* Profiler::phaseName[] = { "stepping", "sampling", "observables", "logging", "formatting", "json", "validation", "export" };
+
+Profiler& profiler() {
+  static Profiler prof;
+  return prof;
+}
+
+PhaseTimer*& PhaseTimer::current() {
+  static thread_local PhaseTimer* timer = NULL;
+  return timer;
+}
+
+// small integer IDs for threads, in order of first use
+static int threadNumber() {
+  static atomic<int> threads (0);
+  static thread_local int number = threads++;
+  return number;
+}
+
+Profiler::Profiler()
+  : enabled(false), tracing(false), maxTraceEvents(1 << 20), droppedTraceEvents(0)
+{
+  fill (self, self + Phases, 0.);
+  fill (calls, calls + Phases, 0);
+}
+
+void Profiler::enable (bool trace) {
+  enabled = true;
+  tracing = trace;
+  startTime = Clock::now();
+}
+
+void Profiler::record (Phase phase, Clock::time_point start, Clock::time_point end, double selfSeconds) {
+  const int thread = threadNumber();
+  lock_guard<mutex> lock (mx);
+  self[phase] += selfSeconds;
+  ++calls[phase];
+  if (tracing) {
+    if (trace.size() < maxTraceEvents) {
+      TraceEvent e;
+      e.phase = phase;
+      e.thread = thread;
+      e.start = chrono::duration_cast<chrono::microseconds> (start - startTime).count();
+      e.duration = chrono::duration_cast<chrono::microseconds> (end - start).count();
+      trace.push_back (e);
+    } else
+      ++droppedTraceEvents;
+  }
+}
+
+json Profiler::report() const {
+  json j;
+  const double wall = chrono::duration<double> (Clock::now() - startTime).count();
+  double timed = 0;
+  for (int p = 0; p < Phases; ++p)
+    if (calls[p]) {
+      j["phases"][phaseName[p]]["seconds"] = self[p];
+      j["phases"][phaseName[p]]["calls"] = calls[p];
+      j["phases"][phaseName[p]]["percent"] = wall > 0 ? (100 * self[p] / wall) : 0;
+      timed += self[p];
+    }
+  j["wallSeconds"] = wall;
+  j["untimedSeconds"] = max (0., wall - timed);  // clamped, as phases timed on worker threads overlap the main thread and can add up to more than the wall time
+  if (droppedTraceEvents)
+    j["droppedTraceEvents"] = droppedTraceEvents;
+  return j;
+}
+
+void Profiler::writeTrace (ostream& out) const {
+  // written by hand, as the trace can be too big to build as a json object
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  for (size_t n = 0; n < trace.size(); ++n) {
+    const TraceEvent& e = trace[n];
+    out << (n ? ",\n" : "\n")
+	<< "{\"name\":\"" << phaseName[e.phase] << "\",\"cat\":\"carnaval\",\"ph\":\"X\",\"pid\":1"
+	<< ",\"tid\":" << e.thread << ",\"ts\":" << e.start << ",\"dur\":" << e.duration << "}";
+  }
+  out << "\n]}" << endl;
+}
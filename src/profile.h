@@ -0,0 +1,77 @@
+#ifndef PROFILE_INCLUDED
+#define PROFILE_INCLUDED
+
+#include <chrono>
+#include <mutex>
+#include <iostream>
+#include "json.hpp"
+#include "vguard.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+// Wall-clock profile of the phases of a run.
+// Time is charged to the innermost active phase on each thread, so the phase totals add up to the time covered by timers.
+// Each timed interval can also be kept as a Chrome trace event (viewable in chrome://tracing or Perfetto).
+// While disabled, a PhaseTimer costs one test of a flag.
+struct Profiler {
+  enum Phase { Stepping, Sampling, Observables, Logging, Formatting, Json, Validation, Export, Phases };
+  static const char* phaseName[];
+
+  typedef chrono::steady_clock Clock;
+  struct TraceEvent {
+    Phase phase;
+    int thread;
+    long long start, duration;  // microseconds since the profiler was enabled
+  };
+
+  bool enabled, tracing;
+  size_t maxTraceEvents;
+  Clock::time_point startTime;
+  double self[Phases];  // seconds, excluding nested phases
+  long calls[Phases];
+  vguard<TraceEvent> trace;
+  long droppedTraceEvents;
+  mutex mx;
+
+  Profiler();
+  void enable (bool trace = false);
+  void record (Phase phase, Clock::time_point start, Clock::time_point end, double selfSeconds);
+  json report() const;
+  void writeTrace (ostream&) const;
+};
+
+Profiler& profiler();
+
+// Scoped timer for one phase
+class PhaseTimer {
+public:
+  PhaseTimer (Profiler::Phase p) : phase(p), active(profiler().enabled), parent(NULL), nested(0) {
+    if (active) {
+      parent = current();
+      current() = this;
+      start = Profiler::Clock::now();
+    }
+  }
+  ~PhaseTimer() { stop(); }
+  void stop() {
+    if (active) {
+      const auto end = Profiler::Clock::now();
+      const double seconds = chrono::duration<double> (end - start).count();
+      profiler().record (phase, start, end, seconds - nested);
+      if (parent)
+	parent->nested += seconds;
+      current() = parent;
+      active = false;
+    }
+  }
+private:
+  Profiler::Phase phase;
+  bool active;
+  PhaseTimer* parent;
+  double nested;
+  Profiler::Clock::time_point start;
+  static PhaseTimer*& current();
+};
+
+#endif /* PROFILE_INCLUDED */
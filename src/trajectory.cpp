@@ -0,0 +1,409 @@
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <unistd.h>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#include "trajectory.h"
+#include "profile.h"
+
+const char TrajectoryHeader::magicString[] = "CARNATRJ";
+const char TrajectoryTrailer::magicString[] = "CARNAIDX";
+
+// varints, with zigzag encoding for signed values
+static inline void putVarint (vguard<unsigned char>& buf, uint64_t n) {
+  while (n >= 0x80) {
+    buf.push_back ((unsigned char) (n | 0x80));
+    n >>= 7;
+  }
+  buf.push_back ((unsigned char) n);
+}
+
+static inline void putSigned (vguard<unsigned char>& buf, int64_t n) {
+  putVarint (buf, ((uint64_t) n << 1) ^ (uint64_t) (n >> 63));
+}
+
+static inline uint64_t getVarint (const unsigned char*& p, const unsigned char* end) {
+  uint64_t n = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    const unsigned char c = *p++;
+    n |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return n;
+  }
+  throw runtime_error ("Trajectory frame is truncated");
+}
+
+static inline int64_t getSigned (const unsigned char*& p, const unsigned char* end) {
+  const uint64_t n = getVarint (p, end);
+  return (int64_t) (n >> 1) ^ -(int64_t) (n & 1);
+}
+
+TrajectoryWriter::TrajectoryWriter (const string& filename, const Board& board, int keyInterval)
+  : out (filename, ios::binary), offset(0), keyInterval(max(keyInterval,1)), lastChainVersion(0), lastKey(0), lastTopology(0), closed(false), restart(false)
+{
+  if (!out)
+    throw runtime_error (string ("Can't write trajectory ") + filename);
+  TrajectoryHeader h;
+  memset (&h, 0, sizeof(h));
+  memcpy (h.magic, TrajectoryHeader::magicString, sizeof(h.magic));
+  h.version = TrajectoryHeader::currentVersion;
+  h.byteOrder = BoardFileHeader::byteOrderMark;
+  h.headerSize = sizeof(h);
+  h.xSize = board.xSize;
+  h.ySize = board.ySize;
+  h.zSize = board.zSize;
+  h.units = board.unit.size();
+  h.splitProb = board.params.splitProb;
+  h.stackEnergy = board.params.stackEnergy;
+  h.auEnergy = board.params.auEnergy;
+  h.gcEnergy = board.params.gcEnergy;
+  h.guEnergy = board.params.guEnergy;
+  h.temp = board.params.temp;
+  h.bondProb = board.params.bondProb;
+  out.write ((const char*) &h, sizeof(h));
+  for (const Unit& u: board.unit)
+    out.put (u.baseChar());
+  offset = sizeof(h) + board.unit.size();
+}
+
+TrajectoryWriter::TrajectoryWriter (const string& filename, const Board& board, long lastMove, int keyInterval)
+  : offset(0), keyInterval(max(keyInterval,1)), lastChainVersion(0), lastKey(0), lastTopology(0), closed(false), restart(true)
+{
+  uint64_t end;
+  {
+    TrajectoryReader reader (filename);
+    if (reader.xSize != board.xSize || reader.ySize != board.ySize || reader.zSize != board.zSize || reader.bases != board.sequence())
+      throw runtime_error (string ("Trajectory ") + filename + " is of a different board");
+    size_t frames = 0;
+    while (frames < reader.frames() && reader.move (frames) <= lastMove)
+      ++frames;
+    index = reader.frameIndex();
+    index.resize (frames);
+    end = frames < reader.frames() ? reader.frameIndex()[frames].offset : reader.framesEnd();
+  }
+  if (!index.empty()) {
+    lastKey = index.back().key;
+    lastTopology = index.back().topology;
+  }
+  if (truncate (filename.c_str(), end) != 0)
+    throw runtime_error (string ("Can't truncate trajectory ") + filename);
+  out.open (filename, ios::binary | ios::app);
+  if (!out)
+    throw runtime_error (string ("Can't write trajectory ") + filename);
+  offset = end;
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+  if (!closed)
+    close();
+}
+
+void TrajectoryWriter::write (const Board& board, long move) {
+  PhaseTimer timer (Profiler::Export);
+  const size_t units = board.unit.size();
+  if (units != (size_t) lastPos.size() && !index.empty() && !restart)
+    throw runtime_error ("Number of units changed during trajectory");
+  const uint32_t frame = index.size();
+  const bool key = frame % keyInterval == 0 || restart;
+  const bool topology = frame == 0 || board.chainVersion != lastChainVersion || restart;
+  TrajectoryFrameHeader fh;
+  memset (&fh, 0, sizeof(fh));
+  fh.flags = (key ? TrajectoryFrameHeader::Key : 0) | (topology ? TrajectoryFrameHeader::Topology : 0);
+  fh.move = move;
+
+  payload.clear();
+  if (topology)
+    for (const Unit& u: board.unit)
+      putVarint (payload, u.prev + 1);
+  if (key) {
+    for (const Unit& u: board.unit) {
+      for (int n = 0; n < 3; ++n)
+	putSigned (payload, u.pos.xyz[n]);
+      payload.push_back (u.rev);
+    }
+  } else {
+    size_t changed = 0;
+    for (size_t i = 0; i < units; ++i)
+      if (!(board.unit[i].pos - lastPos[i]).isZero() || board.unit[i].rev != lastRev[i])
+	++changed;
+    putVarint (payload, changed);
+    size_t skip = 0;
+    for (size_t i = 0; i < units; ++i) {
+      const Unit& u = board.unit[i];
+      const Vec d = u.pos - lastPos[i];
+      if (d.isZero() && u.rev == lastRev[i])
+	++skip;
+      else {
+	putVarint (payload, skip);
+	putSigned (payload, d.x() * 2 + (u.rev ? 1 : 0));  // strand rides in the low bit of dx
+	putSigned (payload, d.y());
+	putSigned (payload, d.z());
+	skip = 0;
+      }
+    }
+  }
+  fh.rawSize = fh.storedSize = payload.size();
+  const vguard<unsigned char>* data = &payload;
+#ifdef USE_ZLIB
+  uLongf size = compressBound (payload.size());
+  stored.resize (size);
+  if (payload.size() > 64 && compress2 (stored.data(), &size, payload.data(), payload.size(), 1) == Z_OK && size < payload.size()) {
+    fh.flags |= TrajectoryFrameHeader::Deflated;
+    fh.storedSize = size;
+    data = &stored;
+  }
+#endif
+
+  TrajectoryIndexEntry entry;
+  entry.offset = offset;
+  entry.move = move;
+  entry.key = key ? frame : lastKey;
+  entry.topology = topology ? frame : lastTopology;
+  index.push_back (entry);
+  lastKey = entry.key;
+  lastTopology = entry.topology;
+
+  out.write ((const char*) &fh, sizeof(fh));
+  out.write ((const char*) data->data(), fh.storedSize);
+  offset += sizeof(fh) + fh.storedSize;
+  if (!out)
+    throw runtime_error ("Error writing trajectory");
+
+  lastPos.resize (units);
+  lastRev.resize (units);
+  for (size_t i = 0; i < units; ++i) {
+    lastPos[i] = board.unit[i].pos;
+    lastRev[i] = board.unit[i].rev;
+  }
+  lastChainVersion = board.chainVersion;
+  restart = false;
+}
+
+void TrajectoryWriter::close() {
+  TrajectoryTrailer t;
+  memcpy (t.magic, TrajectoryTrailer::magicString, sizeof(t.magic));
+  t.indexOffset = offset;
+  t.frames = index.size();
+  out.write ((const char*) index.data(), index.size() * sizeof(TrajectoryIndexEntry));
+  out.write ((const char*) &t, sizeof(t));
+  out.close();
+  closed = true;
+  if (!out)
+    throw runtime_error ("Error writing trajectory index");
+}
+
+TrajectoryReader::TrajectoryReader (const string& filename) : file (filename) {
+  TrajectoryHeader h;
+  const size_t v1HeaderSize = offsetof (TrajectoryHeader, splitProb);
+  if (file.size < v1HeaderSize)
+    throw runtime_error ("Trajectory file is truncated");
+  memcpy (&h, file.data, v1HeaderSize);
+  if (memcmp (h.magic, TrajectoryHeader::magicString, sizeof(h.magic)) != 0)
+    throw runtime_error ("Not a trajectory file");
+  if (h.byteOrder != BoardFileHeader::byteOrderMark)
+    throw runtime_error ("Trajectory file has the wrong byte order for this machine");
+  if (h.version > TrajectoryHeader::currentVersion || h.headerSize < (h.version < 2 ? v1HeaderSize : sizeof(h)) || file.size < h.headerSize)
+    throw runtime_error ("Unsupported trajectory file version");
+  if (h.xSize <= 0 || h.ySize <= 0 || h.zSize <= 0 || h.units > (uint64_t) numeric_limits<int>::max() || h.units > file.size - h.headerSize)
+    throw runtime_error ("Corrupt trajectory header");
+  if (h.version >= 2) {
+    memcpy (&h, file.data, sizeof(h));
+    params.splitProb = h.splitProb;
+    params.stackEnergy = h.stackEnergy;
+    params.auEnergy = h.auEnergy;
+    params.gcEnergy = h.gcEnergy;
+    params.guEnergy = h.guEnergy;
+    params.temp = h.temp;
+    params.bondProb = h.bondProb;
+  }
+  xSize = h.xSize;
+  ySize = h.ySize;
+  zSize = h.zSize;
+  bases = string (file.data + h.headerSize, h.units);
+  dataStart = h.headerSize + h.units;
+  pos.resize (h.units);
+  rev.resize (h.units);
+  prev = vguard<int> (h.units, -1);
+  next = vguard<int> (h.units, -1);
+
+  TrajectoryTrailer t;
+  bool indexed = false;
+  if (file.size >= dataStart + sizeof(t)) {
+    memcpy (&t, file.data + file.size - sizeof(t), sizeof(t));
+    indexed = memcmp (t.magic, TrajectoryTrailer::magicString, sizeof(t.magic)) == 0;
+  }
+  if (indexed) {
+    // the trailer & index come from the file, so check them before trusting any offset
+    const uint64_t indexBytes = file.size - dataStart - sizeof(t);
+    if (t.frames > indexBytes / sizeof(TrajectoryIndexEntry) || t.indexOffset != file.size - sizeof(t) - t.frames * sizeof(TrajectoryIndexEntry))
+      throw runtime_error ("Corrupt trajectory index");
+    index.resize (t.frames);
+    memcpy (index.data(), file.data + t.indexOffset, t.frames * sizeof(TrajectoryIndexEntry));
+    uint64_t minOffset = dataStart;
+    for (size_t f = 0; f < index.size(); ++f) {
+      const TrajectoryIndexEntry& e = index[f];
+      if (e.offset < minOffset || !validFrame (e.offset, t.indexOffset) || e.key > f || e.topology > f)
+	throw runtime_error ("Corrupt trajectory index");
+      minOffset = e.offset + sizeof(TrajectoryFrameHeader);
+    }
+  } else
+    scanFrames (dataStart);  // unfinished file: rebuild the index, dropping any partial frame
+  frame = index.size();
+}
+
+bool TrajectoryReader::validFrame (uint64_t offset, uint64_t limit) const {
+  TrajectoryFrameHeader fh;
+  if (offset > limit || limit - offset < sizeof(fh))
+    return false;
+  memcpy (&fh, file.data + offset, sizeof(fh));
+  // no payload can exceed a topology plus a full delta frame of 10-byte varints
+  const uint64_t maxRawSize = 10 + 50 * (uint64_t) pos.size();
+  return fh.storedSize <= limit - offset - sizeof(fh)
+    && fh.rawSize <= maxRawSize
+    && ((fh.flags & TrajectoryFrameHeader::Deflated) || fh.rawSize == fh.storedSize);
+}
+
+uint64_t TrajectoryReader::framesEnd() const {
+  if (index.empty())
+    return dataStart;
+  TrajectoryFrameHeader fh;
+  memcpy (&fh, file.data + index.back().offset, sizeof(fh));
+  return index.back().offset + sizeof(fh) + fh.storedSize;
+}
+
+void TrajectoryReader::scanFrames (uint64_t offset) {
+  uint32_t key = 0, topology = 0;
+  TrajectoryFrameHeader fh;
+  while (validFrame (offset, file.size)) {
+    memcpy (&fh, file.data + offset, sizeof(fh));
+    TrajectoryIndexEntry entry;
+    entry.offset = offset;
+    entry.move = fh.move;
+    if (fh.flags & TrajectoryFrameHeader::Key)
+      key = index.size();
+    if (fh.flags & TrajectoryFrameHeader::Topology)
+      topology = index.size();
+    entry.key = key;
+    entry.topology = topology;
+    index.push_back (entry);
+    offset += sizeof(fh) + fh.storedSize;
+  }
+}
+
+void TrajectoryReader::decode (size_t f, bool wantTopology, bool wantPositions) {
+  TrajectoryFrameHeader fh;
+  memcpy (&fh, file.data + index[f].offset, sizeof(fh));
+  const unsigned char* p = (const unsigned char*) file.data + index[f].offset + sizeof(fh);
+  if (fh.flags & TrajectoryFrameHeader::Deflated) {
+#ifdef USE_ZLIB
+    buffer.resize (fh.rawSize);
+    uLongf size = fh.rawSize;
+    if (uncompress (buffer.data(), &size, p, fh.storedSize) != Z_OK || size != fh.rawSize)
+      throw runtime_error ("Corrupt compressed trajectory frame");
+    p = buffer.data();
+#else
+    throw runtime_error ("Trajectory is compressed, but this build has no zlib");
+#endif
+  }
+  const unsigned char* end = p + fh.rawSize;
+  const size_t units = pos.size();
+
+  if (fh.flags & TrajectoryFrameHeader::Topology) {
+    if (wantTopology) {
+      fill (next.begin(), next.end(), -1);
+      for (size_t i = 0; i < units; ++i) {
+	const uint64_t n = getVarint (p, end);
+	if (n > units)
+	  throw runtime_error ("Corrupt trajectory topology");
+	prev[i] = (int) n - 1;
+	if (prev[i] == (int) i)
+	  throw runtime_error ("Corrupt trajectory topology");
+	if (prev[i] >= 0)
+	  next[prev[i]] = i;
+      }
+    } else
+      for (size_t i = 0; i < units; ++i)
+	getVarint (p, end);
+  }
+  if (!wantPositions)
+    return;
+
+  if (fh.flags & TrajectoryFrameHeader::Key)
+    for (size_t i = 0; i < units; ++i) {
+      for (int n = 0; n < 3; ++n)
+	pos[i].xyz[n] = getSigned (p, end);
+      if (p >= end)
+	throw runtime_error ("Trajectory frame is truncated");
+      rev[i] = *p++;
+    }
+  else {
+    const uint64_t changed = getVarint (p, end);
+    size_t i = 0;
+    for (uint64_t c = 0; c < changed; ++c, ++i) {
+      const uint64_t skip = getVarint (p, end);
+      if (skip >= units - i)
+	throw runtime_error ("Corrupt trajectory frame");
+      i += skip;
+      const int64_t dxr = getSigned (p, end);
+      pos[i].xyz[0] += (int) (dxr >> 1);
+      rev[i] = dxr & 1;
+      pos[i].xyz[1] += (int) getSigned (p, end);
+      pos[i].xyz[2] += (int) getSigned (p, end);
+    }
+  }
+  frame = f;
+}
+
+bool TrajectoryReader::nextFrame() {
+  const size_t f = frame < index.size() ? frame + 1 : 0;
+  if (f >= index.size())
+    return false;
+  seek (f);
+  return true;
+}
+
+void TrajectoryReader::seek (size_t f) {
+  if (f >= index.size())
+    throw runtime_error ("Trajectory frame out of range");
+  if (f == frame)
+    return;
+  if (frame < index.size() && f == frame + 1 && index[f].key != f) {
+    decode (f, true, true);
+    return;
+  }
+  const TrajectoryIndexEntry& e = index[f];
+  // every topology up to this frame is at or before e.topology
+  decode (e.topology, true, false);
+  for (size_t k = e.key; k <= f; ++k)
+    decode (k, false, true);
+}
+
+Board TrajectoryReader::board() const {
+  Board b (xSize, ySize, zSize);
+  board (b);
+  return b;
+}
+
+void TrajectoryReader::board (Board& b) const {
+  if (frame >= index.size())
+    throw runtime_error ("No trajectory frame has been read");
+  if (b.xSize != xSize || b.ySize != ySize || b.zSize != zSize || b.cellStorage.size() != 2 * (size_t) xSize * ySize * zSize)
+    b = Board (xSize, ySize, zSize);
+  else  // vacate only the cells the last frame's units held
+    for (const Unit& u: b.unit)
+      b.cell (u.pos, u.rev) = -1;
+  b.params = params;
+  b.unit.resize (pos.size());
+  for (size_t i = 0; i < pos.size(); ++i) {
+    Unit& u = b.unit[i];
+    u = Unit (0, 0, 0, 0, rev[i], i, prev[i], next[i]);
+    u.base = Unit::char2base (bases[i]);
+    u.pos = pos[i];
+    b.cell (u.pos, u.rev) = i;
+  }
+  b.initPositionSums();
+  b.touch();
+}
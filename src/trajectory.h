@@ -0,0 +1,105 @@
+#ifndef TRAJECTORY_INCLUDED
+#define TRAJECTORY_INCLUDED
+
+#include <cstdint>
+#include <fstream>
+#include "cell.h"
+#include "boardfile.h"
+
+// Binary trajectory files: frames of a Board's unit positions & strands, recorded every so many moves.
+// Layout (native byte order):
+//   TrajectoryHeader, then the units' bases (one byte each)
+//   frames, each a TrajectoryFrameHeader followed by its payload
+//   index: TrajectoryIndexEntry[frames], then TrajectoryTrailer (absent if the writer didn't finish; readers then scan the frames)
+// Payloads are varint-encoded. A key frame holds every unit's absolute position; other frames hold
+// only the units that changed since the frame before, as run lengths of unchanged units and position deltas.
+// Chain topology (each unit's prev) is included only in frames where it changed, e.g. after a ligation.
+// Payloads are deflated if built with zlib (USE_ZLIB) and it helps.
+// The index gives, for every frame, its offset and the frames holding the latest key & topology,
+// so any frame can be located in O(1) and decoded from at most keyInterval frames.
+
+struct TrajectoryHeader {
+  char magic[8];  // "CARNATRJ"
+  uint32_t version, byteOrder, headerSize, reserved;
+  int32_t xSize, ySize, zSize, reserved2;
+  uint64_t units;
+  double splitProb, stackEnergy, auEnergy, gcEnergy, guEnergy, temp, bondProb;  // version 2 on; version 1 files get default Params
+  static const char magicString[];
+  static const uint32_t currentVersion = 2;
+};
+
+struct TrajectoryFrameHeader {
+  uint32_t flags, rawSize, storedSize, reserved;
+  int64_t move;
+  enum { Key = 1, Topology = 2, Deflated = 4 };
+};
+
+struct TrajectoryIndexEntry {
+  uint64_t offset;
+  int64_t move;
+  uint32_t key, topology;  // frame numbers of the latest key frame & topology, at or before this frame
+};
+
+struct TrajectoryTrailer {
+  char magic[8];  // "CARNAIDX"
+  uint64_t indexOffset, frames;
+  static const char magicString[];
+};
+
+class TrajectoryWriter {
+public:
+  TrajectoryWriter (const string& filename, const Board& board, int keyInterval = 64);
+  // continue an existing trajectory of this board (e.g. when resuming from a checkpoint),
+  // keeping its frames up to & including lastMove and discarding any later ones
+  TrajectoryWriter (const string& filename, const Board& board, long lastMove, int keyInterval = 64);
+  ~TrajectoryWriter();
+  void write (const Board& board, long move);
+  void close();  // writes the index
+  size_t frames() const { return index.size(); }
+private:
+  ofstream out;
+  uint64_t offset;
+  int keyInterval;
+  vguard<TrajectoryIndexEntry> index;
+  vguard<Vec> lastPos;
+  vguard<bool> lastRev;
+  unsigned long long lastChainVersion;
+  uint32_t lastKey, lastTopology;
+  vguard<unsigned char> payload, stored;
+  bool closed, restart;  // restart: the next frame must be a key frame with topology
+};
+
+// Streams frames from a mapped trajectory file; only the frames needed for the current one are decoded.
+class TrajectoryReader {
+public:
+  TrajectoryReader (const string& filename);
+  int xSize, ySize, zSize;
+  Params params;
+  string bases;
+  size_t frames() const { return index.size(); }
+  long move (size_t frame) const { return index[frame].move; }
+  const vguard<TrajectoryIndexEntry>& frameIndex() const { return index; }
+  uint64_t framesEnd() const;  // offset just past the last complete frame
+
+  // current frame
+  size_t frame;  // frames() if none has been read yet
+  vguard<Vec> pos;
+  vguard<bool> rev;
+  vguard<int> prev, next;
+
+  bool nextFrame();  // advance to the next frame; false at the end
+  void seek (size_t frame);
+  Board board() const;  // the current frame as a Board
+  void board (Board&) const;  // the same, reusing a Board's storage (e.g. from the last frame)
+
+private:
+  MappedFile file;
+  uint64_t dataStart;  // offset of the first frame
+  vguard<TrajectoryIndexEntry> index;
+  vguard<unsigned char> buffer;
+  bool validFrame (uint64_t offset, uint64_t limit) const;  // does a plausible frame start at offset and end by limit?
+  void scanFrames (uint64_t start);
+  void decode (size_t frame, bool wantTopology, bool wantPositions);
+};
+
+#endif /* TRAJECTORY_INCLUDED */
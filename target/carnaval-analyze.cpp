@@ -0,0 +1,81 @@
+#include <cstdlib>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <boost/program_options.hpp>
+
+#include "../src/cell.h"
+#include "../src/trajectory.h"
+#include "../src/journal.h"
+#include "../src/analysis.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+int main (int argc, char** argv) {
+
+  try {
+
+    po::options_description opts("Options");
+    opts.add_options()
+      ("help,h", "display this help message")
+      ("input,i", po::value<vector<string> >(), "trajectory (carnaval --trajectory) or journal (carnaval --journal) files to analyze")
+      ("threads,t", po::value<int>(), "number of analysis threads (default is one per core)")
+      ("stride", po::value<long>()->default_value(1), "analyze every Nth trajectory frame")
+      ("period,p", po::value<long>()->default_value(1000), "moves between samples of a journal")
+      ("no-pairs", "don't estimate base-pairing probabilities")
+      ("no-strands", "don't count strand sequences")
+      ("no-folds", "don't count fold strings (these are only counted for frames holding a single linear chain)")
+      ("no-series", "don't report the energy & radius of gyration series")
+      ("output,o", po::value<string>(), "save results to JSON file (default is standard output)")
+      ;
+
+    po::positional_options_description pos;
+    pos.add ("input", -1);
+    po::variables_map vm;
+    po::store (po::command_line_parser(argc,argv).options(opts).positional(pos).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || !vm.count("input")) {
+      cout << "Usage: " << argv[0] << " [options] FILE..." << endl << opts << endl;
+      return 1;
+    }
+
+    const int threads = vm.count("threads") ? vm.at("threads").as<int>() : max (1, (int) thread::hardware_concurrency());
+    const long stride = vm.at("stride").as<long>(), period = vm.at("period").as<long>();
+    if (threads < 1 || stride < 1 || period < 1)
+      throw runtime_error ("Threads, stride and period must be positive");
+
+    json results = json::object();
+    for (const auto& filename: vm.at("input").as<vector<string> >()) {
+      FrameAnalysis analysis (!vm.count("no-pairs"), !vm.count("no-strands"), !vm.count("no-folds"), !vm.count("no-series"));
+      string sequence;
+      ifstream in (filename, ios::binary);
+      char magic[8] = { 0 };
+      in.read (magic, sizeof(magic));
+      if (string (magic, 8) == string (TrajectoryHeader::magicString, 8))
+	analyzeTrajectory (filename, threads, stride, analysis, sequence);
+      else if (string (magic, 8) == string (JournalHeader::magicString, 8))
+	analyzeJournal (filename, threads, period, analysis, sequence);
+      else
+	throw runtime_error (filename + " is neither a trajectory nor a journal");
+      cerr << filename << ": analyzed " << analysis.frames << " frames" << endl;
+      results[filename] = analysis.report (sequence);
+    }
+
+    if (vm.count("output")) {
+      ofstream outfile (vm.at("output").as<string>());
+      if (!outfile)
+	throw runtime_error ("Can't save results to JSON file");
+      outfile << results << endl;
+    } else
+      cout << results << endl;
+
+  } catch (const exception& e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
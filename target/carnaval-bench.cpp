@@ -0,0 +1,225 @@
+#include <cstdlib>
+#include <stdexcept>
+#include <iostream>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <boost/program_options.hpp>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../src/cell.h"
+#include "../src/util.h"
+#include "../src/observer.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+// Benchmark suite: a fixed corpus of folding and replication workloads, run with fixed seeds.
+// Each workload is stepped once without observables (for throughput), then again with its observables
+// (for their cost), and reported as JSON so results can be tracked across releases.
+// Workloads run in forked child processes, so that each one's peak memory is its own.
+
+struct Workload {
+  string name, init;
+  int xSize, ySize, zSize;
+  double density;
+  long unitMoves;
+  vector<string> observe;
+};
+
+string randomSequence (size_t len, int seed) {
+  mt19937 mt (seed);
+  string s;
+  for (size_t n = 0; n < len; ++n)
+    s.push_back ("acgu"[mt() % 4]);
+  return s;
+}
+
+vector<Workload> corpus() {
+  const string hairpin = "AAAAAAAAAGGGGGGGGGUUUUUUUUUCCCCC";  // README example
+  const string tRNA = "GCGGAUUUAGCUCAGUUGGGAGAGCGCCAGACUGAAGAUCUGGAGGUCCUGUGUUCGAUCCACAGAAUUCGCACCA";  // yeast tRNA-Phe, 76nt
+  const vector<string> chainObs { "contacts", "loops", "pair-events" };
+  const vector<string> soupObs { "strands", "pair-events" };
+  vector<Workload> w {
+    { "hairpin", hairpin, 64, 64, 1, 0, 100000, chainObs },
+    { "trna", tRNA, 128, 128, 1, 0, 50000, chainObs },
+    { "chain-1kb", randomSequence (1000, 1), 1024, 64, 1, 0, 2000, chainObs },
+    { "chain-1kb-3d", randomSequence (1000, 1), 1024, 16, 16, 0, 2000, chainObs }
+  };
+  for (double density: { 0.05, 0.2, 0.4 }) {
+    const string d = to_string ((int) (100 * density + .5));
+    w.push_back ({ "soup-2d-64-d" + d, "AACCUUGG", 64, 64, 1, density, 1000, soupObs });
+    w.push_back ({ "soup-2d-256-d" + d, "AACCUUGG", 256, 256, 1, density, 100, soupObs });
+    w.push_back ({ "soup-3d-16-d" + d, "AACCUUGG", 16, 16, 16, density, 1000, soupObs });
+    w.push_back ({ "soup-3d-40-d" + d, "AACCUUGG", 40, 40, 40, density, 100, soupObs });
+  }
+  return w;
+}
+
+// run a workload in a forked child, which sends back its results; its peak resident set size goes in maxResidentKb
+json runForked (const function<json()>& work, long& maxResidentKb) {
+  int fd[2];
+  if (pipe (fd) != 0)
+    throw runtime_error ("Can't create pipe for workload process");
+  cout.flush();
+  cerr.flush();
+  const pid_t pid = fork();
+  if (pid < 0)
+    throw runtime_error ("Can't fork workload process");
+  if (pid == 0) {
+    // child: run, write the results, then exit without running destructors or flushing inherited buffers
+    close (fd[0]);
+    int status = 0;
+    try {
+      const string text = work().dump();
+      for (size_t done = 0; done < text.size(); ) {
+	const ssize_t n = write (fd[1], text.data() + done, text.size() - done);
+	if (n <= 0)
+	  throw runtime_error ("Can't send workload results");
+	done += n;
+      }
+    } catch (const exception& e) {
+      cerr << e.what() << endl;
+      status = 1;
+    }
+    close (fd[1]);
+    _exit (status);
+  }
+  close (fd[1]);
+  string text;
+  char buf[4096];
+  for (ssize_t n; (n = read (fd[0], buf, sizeof(buf))) > 0; )
+    text.append (buf, n);
+  close (fd[0]);
+  int status;
+  rusage usage;
+  if (wait4 (pid, &status, 0, &usage) < 0)
+    throw runtime_error ("Lost workload process");
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    throw runtime_error ("Workload process failed");
+#ifdef __APPLE__
+  maxResidentKb = usage.ru_maxrss / 1024;  // bytes on macOS
+#else
+  maxResidentKb = usage.ru_maxrss;
+#endif
+  return json::parse (text);
+}
+
+Board initBoard (const Workload& w, int seed) {
+  mt19937 mt (seed);
+  Board board (w.xSize, w.ySize, w.zSize);
+  board.addSeq (w.init);
+  if (w.density > 0)
+    board.addBases (w.density, mt);
+  return board;
+}
+
+double elapsed (chrono::steady_clock::time_point start) {
+  return chrono::duration<double> (chrono::steady_clock::now() - start).count();
+}
+
+int main (int argc, char** argv) {
+
+  try {
+
+    po::options_description opts("Options");
+    opts.add_options()
+      ("help,h", "display this help message")
+      ("rnd,r", po::value<int>()->default_value(1), "random number seed")
+      ("scale,s", po::value<double>()->default_value(1), "scale factor for the number of moves in every workload")
+      ("workload,w", po::value<vector<string> >(), "only run workloads whose names contain this string")
+      ("list,l", "list workloads and exit")
+      ;
+
+    po::variables_map vm;
+    po::store (po::command_line_parser(argc,argv).options(opts).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+      cout << opts << endl;
+      return 1;
+    }
+
+    const int seed = vm.at("rnd").as<int>();
+    const double scale = vm.at("scale").as<double>();
+    vector<Workload> workloads;
+    for (const auto& w: corpus()) {
+      bool wanted = !vm.count("workload");
+      if (!wanted)
+	for (const auto& pattern: vm.at("workload").as<vector<string> >())
+	  if (w.name.find (pattern) != string::npos)
+	    wanted = true;
+      if (wanted)
+	workloads.push_back (w);
+    }
+
+    if (vm.count("list")) {
+      for (const auto& w: workloads)
+	cout << w.name << endl;
+      return EXIT_SUCCESS;
+    }
+
+    json results;
+    results["seed"] = seed;
+    results["scale"] = scale;
+    for (const auto& w: workloads) {
+      long maxResidentKb;
+      json jw = runForked ([&] () {
+	  // throughput, without observables
+	  Board board = initBoard (w, seed);
+	  const long moves = max (1L, (long) (scale * w.unitMoves * board.unit.size()));
+	  mt19937 mt (seed);
+	  MoveStats stats;
+	  auto start = chrono::steady_clock::now();
+	  board.run (moves, mt, stats);
+	  const double seconds = elapsed (start);
+
+	  // the same trajectory again, stopping for observables, and finishing them as a run does
+	  Board obsBoard = initBoard (w, seed);
+	  mt19937 obsMt (seed);
+	  ObserverSet observers;
+	  for (const auto& name: w.observe)
+	    observers.add (name);
+	  MoveStats obsStats;
+	  start = chrono::steady_clock::now();
+	  for (long move = 0; move < moves; ) {
+	    const long last = min (moves - 1, observers.nextDue());
+	    observers.events.move = move;
+	    obsBoard.run (last + 1 - move, obsMt, obsStats, observers.events);
+	    move = last + 1;
+	    observers.dispatch (obsBoard, last);
+	  }
+	  observers.finish (obsBoard, moves);
+	  const double obsSeconds = elapsed (start);
+
+	  json jw;
+	  jw["size"] = { w.xSize, w.ySize, w.zSize };
+	  jw["units"] = board.unit.size();
+	  if (w.density > 0)
+	    jw["density"] = w.density;
+	  jw["moves"] = stats.tried;
+	  jw["seconds"] = seconds;
+	  jw["movesPerSecond"] = stats.tried / seconds;
+	  jw["acceptedPerSecond"] = stats.accepted / seconds;
+	  jw["boardBytes"] = board.cellStorage.size() * sizeof(int) + board.unit.size() * sizeof(Unit);
+	  jw["observables"] = w.observe;
+	  jw["observableSeconds"] = max (0., obsSeconds - seconds);
+	  jw["observableOverhead"] = max (0., obsSeconds / seconds - 1);
+	  cerr << w.name << ": " << (long) (stats.tried / seconds) << " moves/sec" << endl;
+	  return jw;
+	}, maxResidentKb);
+      jw["maxResidentKb"] = maxResidentKb;  // peak of this workload's process (both passes)
+      results["workloads"][w.name] = jw;
+    }
+
+    cout << results.dump(1) << endl;
+
+  } catch (const exception& e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,964 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <limits>
+#include <random>
+#include <functional>
+#include <set>
+#include <unistd.h>
+#include <boost/program_options.hpp>
+
+#include "../src/cell.h"
+#include "../src/util.h"
+#include "../src/converge.h"
+#include "../src/boardfile.h"
+#include "../src/trajectory.h"
+#include "../src/journal.h"
+#include "../src/pairmatrix.h"
+#include "../src/observer.h"
+#include "../src/analysis.h"
+#include "../src/bitmap_image.hpp"
+
+using namespace std;
+namespace po = boost::program_options;
+
+// Equivalence tests: the baseline engine against every way of stepping a Board, starting with Board::tryMove itself.
+// The baseline is a separate transcription of the move rules as they were before event hooks, blocks & snapshots,
+// sharing only the Board's primitives (cells, merge rules, energies), so that a fault in tryMove can't hide in both.
+// Engines that claim determinism must reproduce the baseline trajectory exactly, given the same seed.
+// All engines, run with independent seeds, must agree with the baseline (and, where it is known, the exact answer)
+// on stationary pair configurations, energies and acceptance rates, to within a few standard errors.
+// New engines should be added to engines() below.
+
+struct Engine {
+  string name;
+  bool deterministic;  // same seed gives the same trajectory as the baseline
+  function<void(Board&,mt19937&,long,MoveStats&)> step;
+};
+
+// one move, drawing the same random numbers as tryMove
+bool baselineMove (Board& b, mt19937& mt) {
+  if (b.unit.empty())
+    return false;
+  const int index = mt() % b.unit.size();
+  Unit& u = b.unit[index];
+  const Vec newPos = u.pos + b.rndNbrVec (mt);
+  if (!b.canMoveTo (u, newPos))
+    return false;
+  const int nbrIndex = b.cell (newPos, false);
+  const int nbrPairIndex = b.cell (newPos, true);
+  if (b.isPaired (u)) {
+    Unit& p = b.unit[b.pairedIndex(u)];
+    const double oldEnergy = b.pairingEnergy (u, p);
+    if (b.dist(mt) < b.params.splitProb) {
+      if (nbrIndex < 0) {
+	if (!b.acceptMove (-oldEnergy, b.params.splitProb, mt))
+	  return false;
+	b.moveUnit (u, newPos, false);
+	b.moveUnit (p, p.pos, false);
+      } else {
+	Unit& nbr = b.unit[nbrIndex];
+	if (nbrPairIndex >= 0 || !b.canMerge (u, nbr) || !b.acceptMove (b.pairingEnergy(u,nbr) - oldEnergy, 1, mt))
+	  return false;
+	b.moveUnit (u, newPos, true);
+	b.moveUnit (p, p.pos, false);
+      }
+    } else if (nbrIndex < 0 && nbrPairIndex < 0 && b.canMoveTo (p, newPos)) {
+      b.moveUnit (u, newPos, u.rev);
+      b.moveUnit (p, newPos, p.rev);
+      return true;
+    } else if (nbrIndex >= 0 && nbrPairIndex >= 0 && u.next < 0) {
+      Unit& nbr = b.unit[nbrIndex];
+      Unit& nbrp = b.unit[nbrPairIndex];
+      if (p.prev == nbrIndex && nbrp.prev < 0) {
+	nbrp.prev = index;
+	u.next = nbrPairIndex;
+      } else if (p.prev == nbrPairIndex && nbr.prev < 0) {
+	nbr.prev = index;
+	u.next = nbrIndex;
+      } else
+	return false;
+      b.unwrapFrom (index);
+    } else
+      return false;
+  } else if (nbrIndex < 0) {
+    b.moveUnit (u, newPos, false);
+    return true;
+  } else {
+    Unit& nbr = b.unit[nbrIndex];
+    if (nbrPairIndex >= 0 || !b.canMerge (u, nbr) || !b.acceptMove (b.pairingEnergy(u,nbr), 1. / b.params.splitProb, mt))
+      return false;
+    b.moveUnit (u, newPos, true);
+  }
+  b.touch();  // pairs or bonds changed
+  return true;
+}
+
+vector<Engine> engines() {
+  vector<Engine> e;
+  e.push_back ({ "baseline", true, [] (Board& b, mt19937& mt, long moves, MoveStats& stats) {
+	for (long n = 0; n < moves; ++n)
+	  if (baselineMove (b, mt))
+	    ++stats.accepted;
+	stats.tried += moves;
+      } });
+  e.push_back ({ "tryMove", true, [] (Board& b, mt19937& mt, long moves, MoveStats& stats) {
+	for (long n = 0; n < moves; ++n)
+	  if (b.tryMove (mt))
+	    ++stats.accepted;
+	stats.tried += moves;
+      } });
+  e.push_back ({ "run", true, [] (Board& b, mt19937& mt, long moves, MoveStats& stats) {
+	b.run (moves, mt, stats);
+      } });
+  e.push_back ({ "run-counts", true, [] (Board& b, mt19937& mt, long moves, MoveStats& stats) {
+	MoveCounter counter;
+	b.run (moves, mt, stats, counter);
+      } });
+  e.push_back ({ "run-events", true, [] (Board& b, mt19937& mt, long moves, MoveStats& stats) {
+	MoveEventLog log;
+	b.run (moves, mt, stats, log);
+      } });
+  e.push_back ({ "run-blocks", true, [] (Board& b, mt19937& mt, long moves, MoveStats& stats) {
+	// irregular block sizes
+	for (long done = 0, block = 1; done < moves; done += block, block = block * 3 % 97 + 1)
+	  b.run (min (block, moves - done), mt, stats);
+      } });
+  e.push_back ({ "snapshot", true, [] (Board& b, mt19937& mt, long moves, MoveStats& stats) {
+	// continue from a snapshot, as the logging pipeline does
+	Board copy;
+	copy.copyStateFrom (b);
+	copy.run (moves, mt, stats);
+	b.copyStateFrom (copy);
+      } });
+  return e;
+}
+
+int failures = 0;
+
+// temporary files go in a fresh directory, removed at exit
+class TempDir {
+public:
+  TempDir() {
+    const char* tmp = getenv ("TMPDIR");
+    string pattern = string (tmp && *tmp ? tmp : "/tmp") + "/carnaval-equiv.XXXXXX";
+    if (!mkdtemp (&pattern[0]))
+      throw runtime_error ("Can't create a temporary directory");
+    path = pattern;
+  }
+  ~TempDir() {
+    for (const auto& f: files)
+      remove (f.c_str());
+    rmdir (path.c_str());
+  }
+  string file (const string& name) {
+    files.insert (path + "/" + name);
+    return path + "/" + name;
+  }
+private:
+  string path;
+  set<string> files;
+};
+
+string tempFile (const string& name) {
+  static TempDir dir;
+  return dir.file (name);
+}
+
+void check (bool ok, const string& test, const string& detail) {
+  cerr << (ok ? "pass " : "FAIL ") << test << ": " << detail << endl;
+  if (!ok)
+    ++failures;
+}
+
+bool sameState (const Board& a, const Board& b) {
+  if (a.unit.size() != b.unit.size() || a.cellStorage != b.cellStorage)
+    return false;
+  for (size_t n = 0; n < a.unit.size(); ++n) {
+    const Unit& u = a.unit[n];
+    const Unit& v = b.unit[n];
+    if (!(u.pos - v.pos).isZero() || u.rev != v.rev || u.prev != v.prev || u.next != v.next)
+      return false;
+  }
+  return true;
+}
+
+// Shared fixture of the file tests: a seeded run from the initial Board, stepped in blocks,
+// keeping the state after each block to compare with what is read back
+struct RecordedRun {
+  Board board;
+  mt19937 mt;
+  MoveStats stats;
+  vguard<Board> snapshot;
+  RecordedRun (const Board& init, int seed) : board (init), mt (seed) { }
+  // step blocks of moves with the given event hooks, handing each block's end state to record (block, board)
+  template<class Events>
+  void run (long blockMoves, int blocks, Events& events, const function<void(int,const Board&)>& record) {
+    for (int b = 0; b < blocks; ++b) {
+      board.run (blockMoves, mt, stats, events);
+      snapshot.push_back (board);
+      record (snapshot.size() - 1, board);
+    }
+  }
+  void run (long blockMoves, int blocks, const function<void(int,const Board&)>& record) {
+    NullMoveEvents events;
+    run (blockMoves, blocks, events, record);
+  }
+  // readBack (block, board) fills in the state read back for each block in turn, or returns false if it can't
+  void checkReproduced (const string& test, const string& what, const function<bool(int,Board&)>& readBack) const {
+    int same = 0;
+    for (int b = 0; b < (int) snapshot.size(); ++b) {
+      Board board;
+      if (readBack (b, board) && sameState (board, snapshot[b]))
+	++same;
+    }
+    check (same == (int) snapshot.size(), test, to_string (same) + " of " + to_string (snapshot.size()) + " " + what + " reproduced");
+  }
+};
+
+// same seed, same trajectory: compare full state & RNG after every block
+void testTrajectory (const string& label, const Board& init, const Engine& engine, int seed, long blockMoves, int blocks) {
+  const Engine& reference = engines()[0];
+  Board a (init), b (init);
+  mt19937 mtA (seed), mtB (seed);
+  MoveStats statsA, statsB;
+  int block = 0;
+  for (; block < blocks; ++block) {
+    reference.step (a, mtA, blockMoves, statsA);
+    engine.step (b, mtB, blockMoves, statsB);
+    if (!sameState (a, b) || !(mtA == mtB) || statsA.accepted != statsB.accepted)
+      break;
+  }
+  check (block == blocks, label + " trajectory " + engine.name,
+	 block == blocks ? (to_string (blocks * blockMoves) + " moves identical") : ("diverged in block " + to_string (block)));
+}
+
+// saving & loading a board (JSON DOM, streaming JSON, binary) must not change its state or its future trajectory
+void testSerialization (const string& label, const Board& init, int seed, long moves) {
+  RecordedRun run (init, seed);
+  run.run (moves, 1, [] (int, const Board&) { });
+  const Board& board = run.board;
+  const mt19937& mt = run.mt;
+  MoveStats& stats = run.stats;
+
+  ostringstream streamed;
+  writeJsonBoard (board, streamed);
+  const string dom = board.toJson().dump();
+  check (streamed.str() == dom, label + " streamed JSON", streamed.str() == dom ? "identical to toJson" : "differs from toJson");
+
+  istringstream in (streamed.str());
+  json j = json::parse (dom);
+  const string binFile = tempFile ("board.bin");
+  saveBinaryBoard (board, binFile);
+  const Board loaded[] = { readJsonBoard (in), Board::fromJson (j), loadBinaryBoard (binFile) };
+  const char* how[] = { "streamed JSON", "JSON", "binary" };
+  for (int n = 0; n < 3; ++n) {
+    Board a (board), b (loaded[n]);
+    mt19937 mtA (mt), mtB (mt);
+    bool same = sameState (a, b);
+    if (same) {
+      a.run (moves, mtA, stats);
+      b.run (moves, mtB, stats);
+      same = sameState (a, b);
+    }
+    check (same, label + " " + how[n] + " round trip", same ? "state & trajectory preserved" : "state or trajectory changed");
+  }
+
+  // corrupt binary boards must be rejected, not read past their end
+  ostringstream bin;
+  writeBinaryBoard (board, bin, true);
+  const string bytes = bin.str();
+  const size_t unitStart = sizeof(BoardFileHeader);
+  const vguard<function<void(string&)> > corruption = {
+    [] (string& s) { BoardFileHeader h; memcpy (&h, s.data(), sizeof(h)); h.xSize = -h.xSize; memcpy (&s[0], &h, sizeof(h)); },
+    [] (string& s) { BoardFileHeader h; memcpy (&h, s.data(), sizeof(h)); h.units = (uint64_t) -1 / sizeof(PackedUnit) + 2; memcpy (&s[0], &h, sizeof(h)); },
+    [&] (string& s) { PackedUnit u; memcpy (&u, &s[unitStart], sizeof(u)); u.base = 200; memcpy (&s[unitStart], &u, sizeof(u)); },
+    [&] (string& s) { PackedUnit u; memcpy (&u, &s[unitStart], sizeof(u)); u.next = board.unit.size(); memcpy (&s[unitStart], &u, sizeof(u)); },
+    [&] (string& s) { PackedUnit u; memcpy (&u, &s[unitStart], sizeof(u)); u.prev = -7; memcpy (&s[unitStart], &u, sizeof(u)); },
+    [] (string& s) { s.resize (s.size() - 1); }
+  };
+  int rejected = 0;
+  for (const auto& corrupt: corruption) {
+    string bad (bytes);
+    corrupt (bad);
+    try {
+      readBinaryBoard (bad.data(), bad.size());
+    } catch (const runtime_error&) {
+      ++rejected;
+    }
+  }
+  check (rejected == (int) corruption.size(), label + " corrupt binary boards", to_string (rejected) + " of " + to_string (corruption.size()) + " rejected");
+
+  // likewise corrupt JSON boards: out-of-range numbers, dangling or inconsistent chain links
+  size_t linked = 0;
+  while (linked < board.unit.size() && board.unit[linked].prev < 0)
+    ++linked;
+  const int units = board.unit.size(), prev = board.unit[linked].prev;
+  const vguard<function<void(json&)> > jsonCorruption = {
+    [] (json& j) { j["size"][1] = 0; },
+    [] (json& j) { j["size"][0] = 1 << 20; j["size"][1] = 1 << 20; },
+    [&] (json& j) { j["unit"][linked]["pos"][0] = 1LL << 32; },
+    [&] (json& j) { j["unit"][linked]["pos"][2] = 1.5; },
+    [&] (json& j) { j["unit"][linked]["pos"].erase (2); },
+    [&] (json& j) { j["unit"][linked]["prev"] = units; },
+    [&] (json& j) { j["unit"][linked]["prev"] = -7; },
+    [&] (json& j) { j["unit"][linked]["prev"] = (1LL << 32) + prev; },
+    [&] (json& j) { j["unit"][linked]["prev"] = linked; },
+    [&] (json& j) { j["unit"][prev]["next"] = units + 3; },
+    [&] (json& j) { j["unit"][prev]["next"] = prev; },
+    [&] (json& j) {  // a fork: another Unit claims the same prev
+      for (int n = 0; n < units; ++n)
+	if (n != (int) linked && n != prev && board.unit[n].prev >= 0) {
+	  j["unit"][n]["prev"] = prev;
+	  break;
+	}
+    },
+    [&] (json& j) { j["unit"].push_back (j["unit"][linked]); }
+  };
+  int jsonRejected = 0;
+  for (const auto& corrupt: jsonCorruption) {
+    json bad = json::parse (dom);
+    corrupt (bad);
+    istringstream badIn (bad.dump());
+    try {
+      readJsonBoard (badIn);
+    } catch (const runtime_error&) {
+      ++jsonRejected;
+    }
+  }
+  check (jsonRejected == (int) jsonCorruption.size(), label + " corrupt JSON boards", to_string (jsonRejected) + " of " + to_string (jsonCorruption.size()) + " rejected");
+}
+
+// trajectory frames must reproduce the recorded states, read in order, by seeking, or from an unfinished file
+void testTrajectoryFile (const string& label, const Board& init, int seed, long period, int frames) {
+  const string trajFile = tempFile ("run.traj");
+  RecordedRun run (init, seed);
+  const vguard<Board>& snapshot = run.snapshot;
+  {
+    TrajectoryWriter writer (trajFile, init, 8);
+    run.run (period, frames, [&] (int f, const Board& board) { writer.write (board, (f + 1) * period); });
+    writer.close();
+  }
+  // read frames in order, checking their move numbers too
+  auto readInOrder = [&] (TrajectoryReader& reader) {
+    return [&reader, period] (int f, Board& board) {
+      if (!reader.nextFrame() || reader.frame != (size_t) f || reader.move (f) != (long) (f + 1) * period)
+	return false;
+      board = reader.board();
+      return true;
+    };
+  };
+
+  TrajectoryReader reader (trajFile);
+  run.checkReproduced (label + " trajectory file in order", "frames", readInOrder (reader));
+
+  int seeks = 0;
+  mt19937 seekMt (seed);
+  for (int n = 0; n < frames; ++n) {
+    const int f = seekMt() % frames;
+    reader.seek (f);
+    if (sameState (reader.board(), snapshot[f]))
+      ++seeks;
+  }
+  check (seeks == frames, label + " trajectory file seeks", to_string (seeks) + " of " + to_string (frames) + " random seeks reproduced");
+
+  // chop the index and part of the last frame, as if the writer had died
+  uint64_t indexOffset;
+  {
+    TrajectoryTrailer t;
+    ifstream in (trajFile, ios::binary | ios::ate);
+    in.seekg (-(streamoff) sizeof(t), ios::end);
+    in.read ((char*) &t, sizeof(t));
+    indexOffset = t.indexOffset;
+  }
+  if (truncate (trajFile.c_str(), indexOffset - 1) != 0)
+    throw runtime_error ("Can't truncate trajectory");
+  TrajectoryReader unfinished (trajFile);
+  bool same = unfinished.frames() == (size_t) frames - 1;
+  if (same) {
+    unfinished.seek (frames - 2);
+    same = sameState (unfinished.board(), snapshot[frames - 2]);
+  }
+  check (same, label + " unfinished trajectory file", same ? "complete frames recovered" : "frames lost or corrupted");
+
+  // resume the unfinished file halfway, as after a checkpoint, and write the rest again
+  const int kept = frames / 2;
+  {
+    TrajectoryWriter writer (trajFile, init, (long) kept * period, 8);
+    for (int f = kept; f < frames; ++f)
+      writer.write (snapshot[f], (f + 1) * period);
+    writer.close();
+  }
+  TrajectoryReader resumed (trajFile);
+  run.checkReproduced (label + " resumed trajectory file", "frames", readInOrder (resumed));
+
+  // corrupt indices & frame headers must be rejected, not read past the end of the file
+  string bytes;
+  {
+    ifstream in (trajFile, ios::binary);
+    bytes.assign (istreambuf_iterator<char> (in), istreambuf_iterator<char>());
+  }
+  const size_t trailerStart = bytes.size() - sizeof(TrajectoryTrailer);
+  TrajectoryTrailer trailer;
+  memcpy (&trailer, &bytes[trailerStart], sizeof(trailer));
+  const size_t entryStart = trailer.indexOffset + sizeof(TrajectoryIndexEntry);  // frame 1
+  TrajectoryIndexEntry entry;
+  memcpy (&entry, &bytes[entryStart], sizeof(entry));
+  const vguard<function<void(string&)> > corruption = {
+    [&] (string& s) { TrajectoryTrailer t = trailer; t.frames = (uint64_t) 1 << 60; memcpy (&s[trailerStart], &t, sizeof(t)); },
+    [&] (string& s) { TrajectoryTrailer t = trailer; t.indexOffset -= 1; memcpy (&s[trailerStart], &t, sizeof(t)); },
+    [&] (string& s) { TrajectoryIndexEntry e = entry; e.offset = s.size(); memcpy (&s[entryStart], &e, sizeof(e)); },
+    [&] (string& s) { TrajectoryIndexEntry e = entry; e.key = frames + 5; memcpy (&s[entryStart], &e, sizeof(e)); },
+    [&] (string& s) { TrajectoryFrameHeader fh; memcpy (&fh, &s[entry.offset], sizeof(fh)); fh.storedSize = 0xffffffff; memcpy (&s[entry.offset], &fh, sizeof(fh)); },
+    [&] (string& s) { TrajectoryFrameHeader fh; memcpy (&fh, &s[entry.offset], sizeof(fh)); fh.rawSize = 0x7fffffff; memcpy (&s[entry.offset], &fh, sizeof(fh)); }
+  };
+  int rejected = 0;
+  for (const auto& corrupt: corruption) {
+    string bad (bytes);
+    corrupt (bad);
+    {
+      ofstream out (trajFile, ios::binary);
+      out << bad;
+    }
+    try {
+      TrajectoryReader corrupted (trajFile);
+      while (corrupted.nextFrame())
+	;
+    } catch (const runtime_error&) {
+      ++rejected;
+    }
+  }
+  check (rejected == (int) corruption.size(), label + " corrupt trajectory files", to_string (rejected) + " of " + to_string (corruption.size()) + " rejected");
+}
+
+// replaying a move journal must reproduce the journaled run's states, at every block boundary
+void testJournal (const string& label, const Board& init, int seed, long blockMoves, int blocks) {
+  const string journalFile = tempFile ("run.jnl");
+  RecordedRun run (init, seed);
+  {
+    JournalWriter writer (journalFile, init);
+    MoveJournal journal (&writer, 0, 1 << 10);  // small blocks, to cross block boundaries
+    run.run (blockMoves, blocks, journal, [] (int, const Board&) { });
+    journal.flush();
+    writer.finish();
+  }
+  JournalReader reader (journalFile);
+  Board replayed (reader.initial);
+  run.checkReproduced (label + " journal replay", "block states", [&] (int b, Board& board) {
+      reader.replayTo (replayed, (b + 1) * blockMoves - 1);
+      board = replayed;
+      return true;
+    });
+}
+
+// a journal resumed from a checkpoint must hold the same records as one from an uninterrupted run:
+// the moves made after the checkpoint by the interrupted run are discarded, and the resumed run's appended
+void testJournalResume (const string& label, const Board& init, int seed, long blockMoves, int blocks) {
+  const string journalFile = tempFile ("resumed.jnl");
+  const int checkpointBlock = blocks / 2;
+  auto readEvents = [&] (long& endMove) {
+    JournalReader reader (journalFile);
+    vguard<JournalEvent> events;
+    JournalEvent e;
+    while (reader.next (e))
+      events.push_back (e);
+    endMove = reader.endMove;
+    return events;
+  };
+  // uninterrupted, with a block ending at every checkpoint
+  {
+    RecordedRun run (init, seed);
+    JournalWriter writer (journalFile, init);
+    MoveJournal journal (&writer, 0, 1 << 10);
+    run.run (blockMoves, blocks, journal, [&] (int, const Board&) { journal.flush(); });
+    writer.finish();
+  }
+  long refEnd;
+  const vguard<JournalEvent> ref = readEvents (refEnd);
+  // interrupted a block and a half after the checkpoint, then resumed from it
+  const long checkpointMove = checkpointBlock * blockMoves;
+  RecordedRun run (init, seed);
+  Board checkpoint;
+  mt19937 checkpointRng;
+  {
+    JournalWriter writer (journalFile, init);
+    MoveJournal journal (&writer, 0, 1 << 10);
+    run.run (blockMoves, checkpointBlock, journal, [] (int, const Board&) { });
+    journal.flush();
+    writer.sync();
+    checkpoint = run.board;
+    checkpointRng = run.mt;
+    run.run (blockMoves + blockMoves / 2, 1, journal, [] (int, const Board&) { });
+    journal.flush();
+    writer.finish();
+  }
+  bool refused = false;
+  try {
+    JournalWriter writer (journalFile, checkpoint, checkpointMove + 1, true);
+  } catch (const runtime_error&) {
+    refused = true;
+  }
+  run.board = checkpoint;
+  run.mt = checkpointRng;
+  {
+    JournalWriter writer (journalFile, checkpoint, checkpointMove, true);
+    MoveJournal journal (&writer, checkpointMove, 1 << 10);
+    run.run (blockMoves, blocks - checkpointBlock, journal, [&] (int, const Board&) { journal.flush(); });
+    writer.finish();
+  }
+  long resumedEnd;
+  const vguard<JournalEvent> resumed = readEvents (resumedEnd);
+  size_t same = 0;
+  bool continuous = true;
+  for (size_t n = 0; n < resumed.size(); ++n) {
+    if (n > 0 && resumed[n].move <= resumed[n-1].move)
+      continuous = false;
+    if (n < ref.size() && resumed[n].move == ref[n].move && resumed[n].unit == ref[n].unit
+	&& resumed[n].dir == ref[n].dir && resumed[n].type == ref[n].type)
+      ++same;
+  }
+  check (refused, label + " journal resume without a block boundary", refused ? "refused" : "accepted");
+  check (continuous && same == ref.size() && resumed.size() == ref.size() && resumedEnd == refEnd,
+	 label + " resumed journal",
+	 to_string (resumed.size()) + " records (" + to_string (ref.size()) + " uninterrupted), " + to_string (same) + " identical, "
+	 + (continuous ? "moves increasing" : "moves out of order") + ", ending at move " + to_string (resumedEnd));
+}
+
+// offline analysis of a trajectory and a journal of the same run must agree, sample for sample
+void testAnalysis (const string& label, const Board& init, int seed, long period, int frames) {
+  const string trajFile = tempFile ("analyzed.traj"), journalFile = tempFile ("analyzed.jnl");
+  RecordedRun run (init, seed);
+  {
+    TrajectoryWriter trajectory (trajFile, init);
+    JournalWriter writer (journalFile, init);
+    MoveJournal journal (&writer, 0, 1 << 10);
+    run.run (period, frames, journal, [&] (int f, const Board& board) { trajectory.write (board, (f + 1) * period); });
+    journal.flush();
+    writer.finish();
+    trajectory.close();
+  }
+  FrameAnalysis fromTrajectory, fromJournal;
+  string trajSeq, journalSeq;
+  analyzeTrajectory (trajFile, 2, 1, fromTrajectory, trajSeq);
+  analyzeJournal (journalFile, 2, period, fromJournal, journalSeq);
+
+  // a corrupt frame must surface as an exception from the analysis, not kill the process from a worker thread
+  uint64_t frameOffset;
+  {
+    TrajectoryReader reader (trajFile);
+    frameOffset = reader.frameIndex()[frames / 2].offset;
+  }
+  {
+    fstream f (trajFile, ios::binary | ios::in | ios::out);
+    TrajectoryFrameHeader fh;
+    f.seekg (frameOffset);
+    f.read ((char*) &fh, sizeof(fh));
+    f.seekp (frameOffset + sizeof(fh));
+    f << string (fh.storedSize, '\xff');
+  }
+  bool thrown = false;
+  try {
+    FrameAnalysis corrupt;
+    string seq;
+    analyzeTrajectory (trajFile, 2, 1, corrupt, seq);
+  } catch (const runtime_error&) {
+    thrown = true;
+  }
+  check (thrown, label + " corrupt trajectory analysis", thrown ? "error reported" : "no error");
+  json a = fromTrajectory.report (trajSeq), b = fromJournal.report (journalSeq);
+  // radii of gyration are summed from different origins, so may differ in the last digit
+  vguard<double> rgA = a["series"]["radiusOfGyration"], rgB = b["series"]["radiusOfGyration"];
+  bool same = rgA.size() == rgB.size();
+  for (size_t n = 0; same && n < rgA.size(); ++n)
+    same = abs (rgA[n] - rgB[n]) < 1e-9;
+  a["series"].erase ("radiusOfGyration");
+  b["series"].erase ("radiusOfGyration");
+  same = same && a == b && fromTrajectory.frames == frames;
+  check (same, label + " trajectory vs journal analysis",
+	 to_string (fromTrajectory.frames) + " and " + to_string (fromJournal.frames) + " frames" + (same ? ", identical" : ", different"));
+}
+
+// strand-pairs must match the board-wide pair counts on a single strand, and, in a ligating soup,
+// must track (through ligation events) exactly the strands that a full scan of the board finds
+void testStrandPairs (const string& label, const Board& init, int seed, long period, int samples, const vguard<string>& seqs) {
+  Board board (init);
+  mt19937 mt (seed);
+  MoveStats stats;
+  ObserverSet observers;
+  for (const auto& seq: seqs)
+    observers.add (string ("strand-pairs") + (seq.empty() ? "" : "=") + seq + ":" + to_string (period));
+  map<Board::IndexPair,double> pairCount;
+  map<string,long> strandCount;
+  for (int n = 0; n < samples; ++n) {
+    observers.events.move = n * period;
+    board.run (period, mt, stats, observers.events);
+    observers.dispatch (board, (n + 1) * period - 1);
+    board.countPairs (pairCount);
+    for (const auto& s_n: board.sequenceFreqs())
+      strandCount[s_n.first] += s_n.second;
+  }
+  const json report = observers.report();
+  bool same = true;
+  long tracked = 0;
+  for (const auto& seq: seqs) {
+    const json& r = report.at (string ("strand-pairs") + (seq.empty() ? "" : "=") + seq);
+    if (seq.empty()) {
+      json expected = json::object();
+      for (const auto& ij_n: pairCount)
+	expected[to_string(ij_n.first.first)][to_string(ij_n.first.second)] = ij_n.second / samples;
+      same = same && r.value ("prob", json::object()) == expected;
+    } else {
+      const long expected = strandCount.count (seq) ? strandCount.at (seq) : 0;
+      same = same && r.at("strands").get<double>() == (double) expected / samples;
+      tracked += expected;
+    }
+  }
+  check (same, label + " strand-pairs", seqs[0].empty() ? "template matches board-wide pair counts"
+	 : (to_string (tracked) + " strand observations match full scans"));
+}
+
+// event observables, stepped as carnaval steps them, must see every accepted move, including those after their last due pass
+void testEventObservers (const string& label, const Board& init, int seed, long blockMoves, long moves) {
+  Board board (init);
+  mt19937 mt (seed);
+  MoveStats stats;
+  ObserverSet observers;
+  observers.add ("pair-events");
+  for (long move = 0; move < moves; ) {
+    const long last = min (min (move + blockMoves, moves) - 1, observers.nextDue());
+    observers.events.move = move;
+    board.run (last + 1 - move, mt, stats, observers.events);
+    move = last + 1;
+    if (observers.nextDue() <= last)
+      observers.dispatch (board, last);
+  }
+  observers.finish (board, moves);
+  const json report = observers.report();
+  long observed = 0;
+  for (const auto& t_n: report.at("pair-events").at("moves").items())
+    observed += t_n.value().get<long>();
+  check (observed == stats.accepted, label + " pair-events totals", to_string (observed) + " observed, " + to_string (stats.accepted) + " accepted");
+}
+
+// the streamed pair-matrix writers against dense reference matrices
+void testPairExport (const string& label, const Board& init, int seed, long period, int samples) {
+  RecordedRun run (init, seed);
+  PairCountMap pairCount;
+  run.run (period, samples, [&] (int, const Board& board) { board.countPairs (pairCount); });
+  const Board& board = run.board;
+  const size_t n = board.unit.size();
+  const string bmpFile = tempFile ("pairs.bmp");
+  auto bitmapBytes = [&] (size_t size, size_t scale) {
+    bitmap_image image (size, size);
+    for (const auto& ij_n: pairCount) {
+      const int level = min (255, (int) (255.0 * ij_n.second / samples + .5));
+      unsigned char r, g, b;
+      image.get_pixel (ij_n.first.first / scale, ij_n.first.second / scale, r, g, b);
+      image.set_pixel (ij_n.first.first / scale, ij_n.first.second / scale, max ((int) r, level), max ((int) r, level), max ((int) r, level));
+    }
+    image.save_image (bmpFile);
+    ifstream in (bmpFile, ios::binary);
+    return string ((istreambuf_iterator<char> (in)), istreambuf_iterator<char>());
+  };
+  ostringstream bmp, smallBmp;
+  writePairBitmap (pairCount, samples, n, bmp);
+  writePairBitmap (pairCount, samples, n, smallBmp, n / 3);
+  const size_t scale = (n + n / 3 - 1) / (n / 3);
+  check (bmp.str() == bitmapBytes (n, 1) && smallBmp.str() == bitmapBytes ((n + scale - 1) / scale, scale),
+	 label + " pair bitmap", "streamed bitmaps match bitmap_image");
+  // gray levels are probabilities rounded to the nearest 255th: a pair seen in 1 of 4 samples is 64 (0.25 * 255 = 63.75)
+  PairCountMap quarter;
+  quarter[Board::IndexPair (0, 1)] = 1;
+  ostringstream quarterBmp;
+  writePairBitmap (quarter, 4, 2, quarterBmp);
+  const int quarterLevel = (unsigned char) quarterBmp.str().at (54);  // first pixel of the top row, which is written first
+  check (quarterLevel == 64, label + " pair bitmap level", "1 of 4 samples gives " + to_string (quarterLevel));
+
+  vguard<vguard<string> > pp (n, vguard<string> (n));
+  for (const auto& ij_n: pairCount)
+    pp[ij_n.first.first][ij_n.first.second] = to_string (ij_n.second / (double) samples);
+  ostringstream denseCsv, csv;
+  denseCsv << "*," << join (board.sequence(), ",") << endl;
+  for (size_t i = 0; i < n; ++i)
+    denseCsv << board.unit[i].baseChar() << "," << to_string_join (pp[i], ",") << endl;
+  writePairCsv (board, pairCount, samples, csv);
+  check (csv.str() == denseCsv.str(), label + " pair CSV", "streamed CSV matches the dense matrix");
+
+  ostringstream npy, coo;
+  writePairNpy (pairCount, samples, n, npy);
+  writePairCoo (pairCount, samples, coo);
+  const string npyBytes = npy.str();
+  const size_t dataStart = 10 + (unsigned char) npyBytes[8] + 256 * (unsigned char) npyBytes[9];
+  bool npyOk = dataStart % 64 == 0 && npyBytes.size() == dataStart + n * n * sizeof(float);
+  for (size_t i = 0; npyOk && i < n; ++i)
+    for (size_t j = 0; npyOk && j < n; ++j) {
+      float f;
+      memcpy (&f, npyBytes.data() + dataStart + (i * n + j) * sizeof(float), sizeof(float));
+      const auto ij_n = pairCount.find (Board::IndexPair (i, j));
+      npyOk = f == (ij_n == pairCount.end() ? 0.f : (float) (ij_n->second / samples));
+    }
+  size_t cooLines = 0;
+  for (char c: coo.str())
+    cooLines += c == '\n';
+  check (npyOk && cooLines == pairCount.size() + 1, label + " pair npy/coo", to_string (pairCount.size()) + " pairs");
+}
+
+// batch means of a sampled series, and their standard error
+struct Estimate {
+  double mean, stdErr;
+};
+
+Estimate batchEstimate (const vguard<double>& x, size_t batches = 32) {
+  vguard<double> means (batches);
+  const size_t batchSize = x.size() / batches;
+  for (size_t k = 0; k < batches; ++k) {
+    for (size_t i = k * batchSize; i < (k + 1) * batchSize; ++i)
+      means[k] += x[i];
+    means[k] /= batchSize;
+  }
+  return Estimate { seriesMean (means), sqrt (seriesVariance (means) / (batches - 1)) };
+}
+
+string describe (const Estimate& e) {
+  ostringstream s;
+  s << setprecision(4) << e.mean << "+/-" << e.stdErr;
+  return s.str();
+}
+
+const double maxZ = 5;
+
+void compareEstimates (const string& test, const Estimate& ref, const Estimate& est) {
+  const double se = sqrt (ref.stdErr * ref.stdErr + est.stdErr * est.stdErr);
+  const double z = se > 0 ? abs (est.mean - ref.mean) / se : (est.mean == ref.mean ? 0 : numeric_limits<double>::infinity());
+  check (z < maxZ, test, describe (est) + " vs " + describe (ref) + ", z=" + to_string (z));
+}
+
+// a long sampled run
+struct Samples {
+  vguard<double> energy, acceptance, paired;
+  map<string,vguard<double> > fold;  // indicator series of each fold string seen
+};
+
+Samples sample (const Board& init, const Engine& engine, int seed, long period, long nSamples, bool folds) {
+  Board board (init);
+  mt19937 mt (seed);
+  Samples s;
+  MoveStats burnIn;
+  engine.step (board, mt, period * 100, burnIn);
+  for (long n = 0; n < nSamples; ++n) {
+    MoveStats stats;
+    engine.step (board, mt, period, stats);
+    s.energy.push_back (board.foldEnergy());
+    s.acceptance.push_back (((double) stats.accepted) / stats.tried);
+    s.paired.push_back (board.pairList().size());
+    if (folds) {
+      const string f = board.foldString();
+      auto& series = s.fold[f];
+      series.resize (n, 0.);
+      series.push_back (1.);
+    }
+  }
+  for (auto& f_x: s.fold)
+    f_x.second.resize (nSamples, 0.);
+  return s;
+}
+
+// two monomers (G & C) on a small periodic board: exact probability that they are paired is w/(cells-1+w)
+void testMonomerPair (const string& label, int x, int y, int z, int seed, long nSamples) {
+  Board board (x, y, z);
+  board.unit.push_back (Unit (Unit::char2base ('g'), 0, 0, 0, false, 0, -1, -1));
+  board.unit.push_back (Unit (Unit::char2base ('c'), 1, 1, z > 1 ? 1 : 0, false, 1, -1, -1));
+  for (const auto& u: board.unit)
+    board.cell (u.pos, false) = u.index;
+  board.initPositionSums();
+  board.touch();
+  board.assertValid();
+  const double w = exp (board.pairingEnergy (board.unit[0], board.unit[1]) / board.params.temp);
+  const double cells = x * y * z;
+  const double exact = w / (cells - 1 + w);
+  for (const auto& engine: engines()) {
+    const Samples s = sample (board, engine, seed, 10, nSamples, false);
+    const Estimate est = batchEstimate (s.paired);
+    compareEstimates (label + " P(paired) exact " + engine.name, Estimate { exact, 0 }, est);
+  }
+}
+
+// Rao-Blackwellized pair probabilities vs raw pair counts, from independent runs:
+// expected number of pairs, and probability of the outermost pair (first & last Units)
+void testRaoBlackwell (const string& label, const Board& init, int seed, long period, long nSamples) {
+  const Board::IndexPair outer (0, init.unit.size() - 1);
+  Estimate rawTotal, rawOuter;
+  for (int window = 0; window <= 3; ++window) {  // window 0 is raw counting
+    Board board (init);
+    mt19937 mt (seed + window);
+    vguard<double> total, outerProb;
+    MoveStats stats;
+    board.run (period * 100, mt, stats);
+    for (long n = 0; n < nSamples; ++n) {
+      board.run (period, mt, stats);
+      map<Board::IndexPair,double> pairs;
+      if (window)
+	board.creditPairProbs (pairs, window);
+      else
+	board.countPairs (pairs);
+      double sum = 0;
+      for (const auto& ij_p: pairs)
+	sum += ij_p.second;
+      total.push_back (sum);
+      outerProb.push_back (pairs.count (outer) ? pairs.at (outer) : 0.);
+    }
+    if (!window) {
+      rawTotal = batchEstimate (total);
+      rawOuter = batchEstimate (outerProb);
+    } else {
+      const string prefix = label + " Rao-Blackwell window " + to_string (window) + " ";
+      compareEstimates (prefix + "pairs", rawTotal, batchEstimate (total));
+      compareEstimates (prefix + "outer pair", rawOuter, batchEstimate (outerProb));
+    }
+  }
+}
+
+// folding on a small board: stationary fold distribution, energy & acceptance vs reference, with independent seeds
+void testFolding (const string& label, const Board& board, int seed, long period, long nSamples, double minFreq) {
+  const auto eng = engines();
+  const Samples ref = sample (board, eng[0], seed, period, nSamples, true);
+  for (size_t e = 1; e < eng.size(); ++e) {
+    const Samples s = sample (board, eng[e], seed + e, period, nSamples, true);
+    const string prefix = label + " " + eng[e].name + " ";
+    compareEstimates (prefix + "energy", batchEstimate (ref.energy), batchEstimate (s.energy));
+    compareEstimates (prefix + "acceptance", batchEstimate (ref.acceptance), batchEstimate (s.acceptance));
+    int folds = 0;
+    for (const auto& f_x: ref.fold) {
+      const Estimate refFreq = batchEstimate (f_x.second);
+      if (refFreq.mean < minFreq)
+	continue;
+      const auto iter = s.fold.find (f_x.first);
+      const Estimate freq = iter == s.fold.end() ? Estimate { 0, 0 } : batchEstimate (iter->second);
+      compareEstimates (prefix + "fold " + f_x.first, refFreq, freq);
+      ++folds;
+    }
+    check (folds > 0, prefix + "folds", to_string (folds) + " common folds compared");
+  }
+}
+
+// replication soup: ligation is irreversible, so compare ensembles of replicate runs at a fixed time
+void testSoup (const string& label, const Board& board, int seed, long moves, int replicates) {
+  const auto eng = engines();
+  auto ensemble = [&] (const Engine& engine, int firstSeed, vguard<double>& pairs, vguard<double>& bonds, vguard<double>& acceptance) {
+    for (int r = 0; r < replicates; ++r) {
+      Board b (board);
+      mt19937 mt (firstSeed + r);
+      MoveStats stats;
+      engine.step (b, mt, moves, stats);
+      long nBonds = 0;
+      for (const auto& u: b.unit)
+	if (u.next >= 0)
+	  ++nBonds;
+      pairs.push_back (b.pairList().size());
+      bonds.push_back (nBonds);
+      acceptance.push_back (((double) stats.accepted) / stats.tried);
+    }
+  };
+  vguard<double> refPairs, refBonds, refAcc;
+  ensemble (eng[0], seed, refPairs, refBonds, refAcc);
+  for (size_t e = 1; e < eng.size(); ++e) {
+    vguard<double> pairs, bonds, acc;
+    ensemble (eng[e], seed + 1000 * e, pairs, bonds, acc);
+    const string prefix = label + " " + eng[e].name + " ";
+    compareEstimates (prefix + "pairs", batchEstimate (refPairs, replicates), batchEstimate (pairs, replicates));
+    compareEstimates (prefix + "bonds", batchEstimate (refBonds, replicates), batchEstimate (bonds, replicates));
+    compareEstimates (prefix + "acceptance", batchEstimate (refAcc, replicates), batchEstimate (acc, replicates));
+  }
+}
+
+int main (int argc, char** argv) {
+
+  try {
+
+    po::options_description opts("Options");
+    opts.add_options()
+      ("help,h", "display this help message")
+      ("rnd,r", po::value<int>()->default_value(1), "random number seed")
+      ("scale,s", po::value<double>()->default_value(1), "scale factor for run lengths")
+      ;
+
+    po::variables_map vm;
+    po::store (po::command_line_parser(argc,argv).options(opts).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+      cout << opts << endl;
+      return 1;
+    }
+
+    const int seed = vm.at("rnd").as<int>();
+    const double scale = vm.at("scale").as<double>();
+    auto scaled = [scale] (long n) { return max (1L, (long) (n * scale)); };
+
+    // bitwise-identical trajectories
+    Board hairpin (16, 16, 1);
+    hairpin.addSeq ("GGGGAAAACCCC");
+    mt19937 soupMt (seed);
+    Board soup (12, 12, 1);
+    soup.addSeq ("AACCUUGG");
+    soup.addBases (0.3, soupMt);
+    Board soup3d (8, 8, 8);
+    soup3d.addSeq ("AACCUUGG");
+    soup3d.addBases (0.1, soupMt);
+    for (const auto& engine: engines())
+      if (engine.deterministic && engine.name != "baseline") {
+	testTrajectory ("hairpin", hairpin, engine, seed, scaled (10000), 20);
+	testTrajectory ("soup", soup, engine, seed, scaled (10000), 20);
+	testTrajectory ("soup-3d", soup3d, engine, seed, scaled (10000), 20);
+      }
+
+    testSerialization ("hairpin", hairpin, seed, scaled (100000));
+    testSerialization ("soup", soup, seed, scaled (100000));
+    testSerialization ("soup-3d", soup3d, seed, scaled (100000));
+    testTrajectoryFile ("hairpin", hairpin, seed, scaled (1000), 50);
+    Board ligatingSoup (soup);
+    ligatingSoup.params.bondProb = .5;  // so that chain topology changes between frames
+    testTrajectoryFile ("ligating-soup", ligatingSoup, seed, scaled (1000), 50);
+    testJournal ("hairpin", hairpin, seed, scaled (10000), 20);
+    testJournal ("ligating-soup", ligatingSoup, seed, scaled (10000), 20);
+    testJournal ("soup-3d", soup3d, seed, scaled (10000), 20);
+    testJournalResume ("hairpin", hairpin, seed, scaled (10000), 10);
+    testJournalResume ("ligating-soup", ligatingSoup, seed, scaled (10000), 10);
+    testPairExport ("hairpin", hairpin, seed, 100, 200);
+    testAnalysis ("hairpin", hairpin, seed, scaled (1000), 40);
+    testAnalysis ("ligating-soup", ligatingSoup, seed, scaled (1000), 40);
+    testStrandPairs ("hairpin", hairpin, seed, 100, 1000, vguard<string> { "" });
+    vguard<string> dimers;
+    for (char a: string ("acgu"))
+      for (char b: string ("acgu"))
+	dimers.push_back (string (1, a) + b);
+    testStrandPairs ("ligating-soup", ligatingSoup, seed, 1000, 200, dimers);
+    testEventObservers ("soup", ligatingSoup, seed, 10000, 150000);
+    testPairExport ("soup", soup, seed, 1000, 200);
+
+    // exact stationary distribution
+    testMonomerPair ("monomers-2d", 4, 4, 1, seed, scaled (200000));
+    testMonomerPair ("monomers-3d", 3, 3, 3, seed, scaled (200000));
+
+    // stationary distributions vs reference
+    Board small (10, 10, 1);
+    small.addSeq ("GGGAAACCC");
+    small.params.temp = 2;  // melt it a little, for a spread of folds
+    testFolding ("folding", small, seed, 50, scaled (100000), .02);
+    testRaoBlackwell ("folding", small, seed, 50, scaled (100000));
+
+    // finite-time ensembles with ligation
+    testSoup ("soup", soup, seed, scaled (20000), 64);
+
+  } catch (const exception& e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  cerr << (failures ? to_string (failures) + " test(s) failed" : string ("All tests passed")) << endl;
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
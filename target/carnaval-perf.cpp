@@ -0,0 +1,131 @@
+#include <cstdlib>
+#include <stdexcept>
+#include <iostream>
+#include <random>
+#include <chrono>
+#include <boost/program_options.hpp>
+
+#include "../src/cell.h"
+#include "../src/util.h"
+#include "../src/perfcount.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+// Hardware counter benchmark for tryMove.
+// For each board size and monomer density, runs an unmeasured warm-up block,
+// then reads cycles, instructions, cache misses and branch misses around each measured block of moves,
+// and reports them per move as JSON. Without counters, only timings are reported.
+
+Vec parseSize (const string& s) {
+  Vec size (1, 1, 1);
+  size_t pos = 0;
+  for (int d = 0; d < 3 && pos <= s.size(); ++d) {
+    const size_t x = s.find ('x', pos);
+    size.xyz[d] = stoi (s.substr (pos, x == string::npos ? string::npos : x - pos));
+    if (x == string::npos)
+      break;
+    pos = x + 1;
+  }
+  return size;
+}
+
+template<class Events>
+void measure (Board& board, mt19937& mt, long blockMoves, int blocks, PerfCounters& perf, MoveStats& stats, double& seconds, Events& events) {
+  board.run (blockMoves, mt, stats, events);  // warm-up
+  stats = MoveStats();
+  perf.reset();
+  seconds = 0;
+  for (int b = 0; b < blocks; ++b) {
+    const auto start = chrono::steady_clock::now();
+    perf.start();
+    board.run (blockMoves, mt, stats, events);
+    perf.stop();
+    seconds += chrono::duration<double> (chrono::steady_clock::now() - start).count();
+  }
+}
+
+int main (int argc, char** argv) {
+
+  try {
+
+    po::options_description opts("Options");
+    opts.add_options()
+      ("help,h", "display this help message")
+      ("size,s", po::value<vector<string> >()->multitoken(), "board sizes, as XxY or XxYxZ (default 32x32 64x64 256x256 16x16x16)")
+      ("density,d", po::value<vector<double> >()->multitoken(), "monomer densities (default 0.05 0.2 0.4)")
+      ("init,i", po::value<string>(), "template sequence added before the monomers")
+      ("moves,m", po::value<long>()->default_value(1000000), "moves per measured block")
+      ("blocks,b", po::value<int>()->default_value(5), "measured blocks per configuration")
+      ("hooks", po::value<string>()->default_value("none"), "move event hooks to compile in: none or counts")
+      ("rnd,r", po::value<int>()->default_value(1), "random number seed")
+      ;
+
+    po::variables_map vm;
+    po::store (po::command_line_parser(argc,argv).options(opts).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+      cout << opts << endl;
+      return 1;
+    }
+
+    const vector<string> sizes = vm.count("size")
+      ? vm.at("size").as<vector<string> >()
+      : vector<string> { "32x32", "64x64", "256x256", "16x16x16" };
+    const vector<double> densities = vm.count("density")
+      ? vm.at("density").as<vector<double> >()
+      : vector<double> { 0.05, 0.2, 0.4 };
+    const long blockMoves = vm.at("moves").as<long>();
+    const int blocks = vm.at("blocks").as<int>();
+    const string hooks = vm.at("hooks").as<string>();
+    if (hooks != "none" && hooks != "counts")
+      throw runtime_error (string ("Unknown hooks: ") + hooks);
+
+    PerfCounters perf;
+    if (!perf.available())
+      cerr << "Hardware counters unavailable (" << perf.unavailable << "); reporting timings only" << endl;
+
+    json results = json::array();
+    for (const string& sizeStr: sizes)
+      for (double density: densities) {
+	const Vec size = parseSize (sizeStr);
+	mt19937 mt (vm.at("rnd").as<int>());
+	Board board (size.x(), size.y(), size.z());
+	if (vm.count("init"))
+	  board.addSeq (vm.at("init").as<string>());
+	board.addBases (density, mt);
+
+	MoveStats stats;
+	double seconds;
+	if (hooks == "none") {
+	  NullMoveEvents events;
+	  measure (board, mt, blockMoves, blocks, perf, stats, seconds, events);
+	} else {
+	  MoveCounter events;
+	  measure (board, mt, blockMoves, blocks, perf, stats, seconds, events);
+	}
+
+	json jr;
+	jr["size"] = { size.x(), size.y(), size.z() };
+	jr["density"] = density;
+	jr["units"] = board.unit.size();
+	jr["hooks"] = hooks;
+	jr["moves"] = stats.tried;
+	jr["seconds"] = seconds;
+	jr["nsPerMove"] = 1e9 * seconds / stats.tried;
+	jr["acceptance"] = ((double) stats.accepted) / stats.tried;
+	jr["perMove"] = perf.report (stats.tried);
+	results.push_back (jr);
+	cerr << sizeStr << " density " << density << ": " << jr["nsPerMove"].get<double>() << " ns/move" << endl;
+      }
+
+    cout << results << endl;
+
+  } catch (const exception& e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
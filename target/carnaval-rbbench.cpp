@@ -0,0 +1,162 @@
+#include <cstdlib>
+#include <stdexcept>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <boost/program_options.hpp>
+
+#include "../src/cell.h"
+#include "../src/util.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+// Convergence benchmark: raw pair counting vs Rao-Blackwellized pair probabilities, for several window sizes.
+// The reference pair matrix is the mean of several long, independent raw-counting runs;
+// its own standard error is reported, since the test runs can't be scored more finely than that.
+// (Exact enumeration is no good as a reference: the lattice moves can't reach every conformation,
+// e.g. four Units locked in a square by their crossing bonds, so the chain isn't Boltzmann-distributed over all of them.)
+// Shorter replicate runs are scored by their RMS error against it, using every estimator on the same trajectory.
+
+typedef map<Board::IndexPair,double> PairProbs;
+
+struct EstimatorRun {
+  PairProbs raw;
+  vguard<PairProbs> rb;  // one per window size
+  long samples;
+  EstimatorRun() : samples(0) { }
+};
+
+EstimatorRun runEstimators (const Board& init, long moves, long period, int seed, const vguard<int>& windows) {
+  Board board (init);
+  mt19937 mt (seed);
+  EstimatorRun run;
+  run.rb.resize (windows.size());
+  for (long move = 0; move < moves; ++move) {
+    board.tryMove (mt);
+    if (move % period == 0) {
+      board.countPairs (run.raw);
+      for (size_t w = 0; w < windows.size(); ++w)
+	board.creditPairProbs (run.rb[w], windows[w]);
+      ++run.samples;
+    }
+  }
+  for (auto& ij_p: run.raw)
+    ij_p.second /= run.samples;
+  for (auto& rb: run.rb)
+    for (auto& ij_p: rb)
+      ij_p.second /= run.samples;
+  return run;
+}
+
+double rmsError (const PairProbs& est, const PairProbs& ref, size_t nUnits) {
+  double sq = 0;
+  for (const auto& ij_p: ref) {
+    const auto iter = est.find (ij_p.first);
+    const double d = (iter == est.end() ? 0 : iter->second) - ij_p.second;
+    sq += d*d;
+  }
+  for (const auto& ij_p: est)
+    if (!ref.count (ij_p.first))
+      sq += ij_p.second * ij_p.second;
+  const double nPairs = nUnits * (nUnits - 1) / 2.;
+  return sqrt (sq / nPairs);
+}
+
+int main (int argc, char** argv) {
+
+  try {
+
+    po::options_description opts("Options");
+    opts.add_options()
+      ("help,h", "display this help message")
+      ("xsize,x", po::value<int>()->default_value(12), "size of board in X dimension")
+      ("ysize,y", po::value<int>()->default_value(12), "size of board in Y dimension")
+      ("zsize,z", po::value<int>()->default_value(1), "size of board in Z dimension")
+      ("init,i", po::value<string>()->default_value("GGGAAAACCC"), "sequence to fold")
+      ("temp,T", po::value<double>()->default_value(4), "temperature (the default makes the pairs weak)")
+      ("rnd,r", po::value<int>()->default_value(1), "base random number seed")
+      ("period,p", po::value<long>()->default_value(100), "sampling period")
+      ("reference,f", po::value<long>()->default_value(1000000), "moves per unit for each reference run")
+      ("reference-runs,R", po::value<int>()->default_value(4), "number of independent reference runs")
+      ("window,w", po::value<vector<int> >()->multitoken(), "window sizes for the Rao-Blackwellized estimator")
+      ("unit-moves,u", po::value<vector<long> >()->multitoken(), "moves per unit for the test runs")
+      ("replicates,n", po::value<int>()->default_value(8), "number of test runs per move budget")
+      ;
+
+    po::variables_map vm;
+    po::store (po::command_line_parser(argc,argv).options(opts).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+      cout << opts << endl;
+      return 1;
+    }
+
+    Board board (vm["xsize"].as<int>(), vm["ysize"].as<int>(), vm["zsize"].as<int>());
+    board.addSeq (vm.at("init").as<string>());
+    board.params.temp = vm.at("temp").as<double>();
+    board.assertLinear();
+
+    const size_t nUnits = board.unit.size();
+    const long period = vm.at("period").as<long>();
+    const int seed = vm.at("rnd").as<int>();
+    const int replicates = vm.at("replicates").as<int>();
+    const vector<long> budgets = vm.count("unit-moves")
+      ? vm.at("unit-moves").as<vector<long> >()
+      : vector<long> { 1000, 10000, 100000 };
+    const vector<int> windowList = vm.count("window")
+      ? vm.at("window").as<vector<int> >()
+      : vector<int> { 1, 2, 3 };
+    const vguard<int> windows (windowList.begin(), windowList.end());
+
+    const int refRuns = vm.at("reference-runs").as<int>();
+    if (refRuns < 2)
+      throw runtime_error ("Need at least two reference runs, to estimate the reference error");
+    cerr << "Computing reference pair probabilities" << endl;
+    vguard<PairProbs> refRun;
+    for (int r = 0; r < refRuns; ++r)
+      refRun.push_back (runEstimators (board, nUnits * vm.at("reference").as<long>(), period, seed + r, vguard<int>()).raw);
+    PairProbs ref;
+    for (const auto& run: refRun)
+      for (const auto& ij_p: run)
+	ref[ij_p.first] += ij_p.second / refRuns;
+    // standard error of the mean, from the spread of the runs about it
+    double refVar = 0;
+    for (const auto& run: refRun) {
+      const double err = rmsError (run, ref, nUnits);
+      refVar += err * err / (refRuns - 1);
+    }
+    cout << "reference-rmse\t" << setprecision(4) << sqrt (refVar / refRuns) << endl;
+
+    cout << "unit-moves\tsamples\traw-rmse";
+    for (int w: windows)
+      cout << "\trb" << w << "-rmse\tratio" << w;
+    cout << endl;
+    for (long unitMoves: budgets) {
+      double rawErr = 0;
+      vguard<double> rbErr (windows.size(), 0);
+      long samples = 0;
+      for (int rep = 0; rep < replicates; ++rep) {
+	const EstimatorRun run = runEstimators (board, nUnits * unitMoves, period, seed + refRuns + rep, windows);
+	rawErr += rmsError (run.raw, ref, nUnits) / replicates;
+	for (size_t w = 0; w < windows.size(); ++w)
+	  rbErr[w] += rmsError (run.rb[w], ref, nUnits) / replicates;
+	samples = run.samples;
+      }
+      cout << unitMoves
+	   << "\t" << samples
+	   << "\t" << setprecision(4) << rawErr;
+      for (double err: rbErr)
+	cout << "\t" << setprecision(4) << err
+	     << "\t" << setprecision(3) << (err > 0 ? rawErr / err : 0);
+      cout << endl;
+    }
+
+  } catch (const exception& e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
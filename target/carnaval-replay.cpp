@@ -0,0 +1,104 @@
+#include <cstdlib>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <limits>
+#include <boost/program_options.hpp>
+
+#include "../src/cell.h"
+#include "../src/journal.h"
+#include "../src/observer.h"
+#include "../src/boardfile.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+// Replays a move journal recorded with carnaval --journal:
+// reconstructs the board at any move, and accumulates observables offline exactly as they would have been inline.
+int main (int argc, char** argv) {
+
+  try {
+
+    po::options_description opts("Options");
+    opts.add_options()
+      ("help,h", "display this help message")
+      ("journal,J", po::value<string>(), "journal file to replay")
+      ("move,M", po::value<long>(), "stop after this move number (default is the end of the journal)")
+      ("observe,o", po::value<vector<string> >(), "accumulate a named observable, optionally specifying its period as NAME:PERIOD (contacts, loops, strands, pair-events, strand-pairs[=SEQUENCE])")
+      ("observations,O", po::value<string>(), "save observables to JSON file (default is to print them on standard error)")
+      ("save,s", po::value<string>(), "save the replayed board state to file (binary if the filename ends in .bin, otherwise JSON)")
+      ("no-board", "don't print the replayed board state on standard output")
+      ;
+
+    po::positional_options_description pos;
+    pos.add ("journal", 1);
+    po::variables_map vm;
+    po::store (po::command_line_parser(argc,argv).options(opts).positional(pos).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || !vm.count("journal")) {
+      cout << "Usage: " << argv[0] << " [options] JOURNAL" << endl << opts << endl;
+      return 1;
+    }
+
+    JournalReader reader (vm.at("journal").as<string>());
+    Board board = reader.initial;
+    const long stopMove = vm.count("move") ? vm.at("move").as<long>() : numeric_limits<long>::max();
+
+    ObserverSet observers;
+    if (vm.count("observe"))
+      for (const auto& spec: vm.at("observe").as<vector<string> >())
+	observers.add (spec);
+    // as in a live run, observables due at move M see the state after move M and the events up to it
+    auto dispatchBefore = [&] (long move) {
+      while (!observers.empty() && observers.nextDue() < move && observers.nextDue() < stopMove)
+	observers.dispatch (board, observers.nextDue());
+    };
+
+    JournalEvent e;
+    long replayed = 0;
+    while (reader.next (e) && e.move <= stopMove) {
+      dispatchBefore (e.move);
+      observers.events.move = e.move;
+      board.replayMove (e.unit, e.dir, e.type, observers.events);
+      if (!observers.wantsEvents())
+	observers.events.event.clear();
+      ++replayed;
+    }
+    dispatchBefore (min (reader.endMove, stopMove + 1));
+    observers.finish (board, min (reader.endMove, stopMove + 1));
+    cerr << "Replayed " << replayed << " moves from move " << reader.firstMove << endl;
+
+    if (!observers.empty()) {
+      if (vm.count("observations")) {
+	ofstream outfile (vm.at("observations").as<string>());
+	if (!outfile)
+	  throw runtime_error ("Can't save observables to JSON file");
+	outfile << observers.report() << endl;
+      } else
+	cerr << observers.report() << endl;
+    }
+
+    if (vm.count("save")) {
+      const string& filename = vm.at("save").as<string>();
+      if (filename.size() > 4 && filename.substr (filename.size() - 4) == ".bin")
+	saveBinaryBoard (board, filename);
+      else {
+	ofstream outfile (filename);
+	if (!outfile)
+	  throw runtime_error ("Can't save board file");
+	writeJsonBoard (board, outfile);
+	outfile << endl;
+      }
+    } else if (!vm.count("no-board")) {
+      writeJsonBoard (board, cout);
+      cout << endl;
+    }
+
+  } catch (const exception& e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -5,11 +5,23 @@
 #include <fstream>
 #include <iomanip>
 #include <random>
+#include <memory>
+#include <limits>
+#include <chrono>
+#include <unistd.h>
 #include <boost/program_options.hpp>
 
 #include "../src/cell.h"
 #include "../src/util.h"
-#include "../src/bitmap_image.hpp"
+#include "../src/converge.h"
+#include "../src/pipeline.h"
+#include "../src/observer.h"
+#include "../src/profile.h"
+#include "../src/boardfile.h"
+#include "../src/checkpoint.h"
+#include "../src/trajectory.h"
+#include "../src/journal.h"
+#include "../src/pairmatrix.h"
 
 using namespace std;
 namespace po = boost::program_options;
@@ -38,13 +50,39 @@ int main (int argc, char** argv) {
       ("folds,f",  "periodically log move count, fold string, energy, radius of gyration, and centroid (single-chain simulations only)")
       ("seqs,S",  "periodically log sequences (for replication simulations)")
       ("monochrome,m",  "no ANSI color codes in logging, please")
+      ("log-threads",  po::value<int>(), "number of background threads formatting log output (0 to log inline; default is 1 on multicore machines, unless --checkpoint-fork)")
       ("period,p", po::value<long>()->default_value(1000), "logging period")
+      ("adaptive-period,a", "adapt logging period to the autocorrelation times of energy, basepair count and radius of gyration")
       ("temp,T",  po::value<double>(), "specify temperature")
-      ("load,l", po::value<string>(), "load board state from file")
-      ("save,s", po::value<string>(), "save board state to file")
+      ("load,l", po::value<string>(), "load board state from file (JSON or binary, detected automatically)")
+      ("save,s", po::value<string>(), "save board state to file (binary if the filename ends in .bin, otherwise JSON)")
+      ("binary", "save board state in binary format, whatever the filename")
+      ("no-board", "don't print the final board state on standard output")
       ("json,j", po::value<string>(), "save base-pairing posterior probabilities to JSON file")
       ("bitmap,b", po::value<string>(), "save base-pairing probabilities to bitmap image file")
+      ("bitmap-size", po::value<size_t>(), "downsample the bitmap to at most N pixels across, showing the highest probability in each block")
       ("csv,c", po::value<string>(), "save base-pairing probabilities to CSV file")
+      ("coo", po::value<string>(), "save nonzero base-pairing probabilities to a sparse CSV file, one i,j,prob line per pair")
+      ("npy", po::value<string>(), "save base-pairing probabilities to a dense float32 matrix in NumPy .npy format")
+      ("observe,o", po::value<vector<string> >(), "accumulate a named observable, optionally specifying its period as NAME:PERIOD (contacts, loops, strands, pair-events, strand-pairs[=SEQUENCE])")
+      ("observations,O", po::value<string>(), "save observables to JSON file (default is to print them on standard error)")
+      ("trajectory", po::value<string>(), "record a compact binary trajectory of the first replica to a file")
+      ("trajectory-period", po::value<long>(), "moves between trajectory frames (default is the logging period)")
+      ("journal", po::value<string>(), "record every accepted move of the first replica to a journal file, for exact replay (see carnaval-replay)")
+      ("stats", po::value<string>(), "save move outcome counts, acceptance ratios and throughput to JSON file")
+      ("validate", po::value<long>(), "check the consistency of the whole board every N moves")
+      ("profile", "report wall time spent in each phase of the run (stepping, sampling, logging, output...) on standard error")
+      ("trace", po::value<string>(), "save a timeline of the phases of the run to a Chrome trace-event JSON file")
+      ("rao-blackwell,R", "estimate base-pairing probabilities from conditional pairing probabilities, rather than by counting pairs")
+      ("rb-window", po::value<int>()->default_value(2), "number of consecutive units re-placed together by --rao-blackwell")
+      ("replicas,n", po::value<int>()->default_value(1), "number of independent replicas to simulate (logging follows the first)")
+      ("precision,P", po::value<double>(), "stop early, after burn-in, once all base-pairing probabilities have this standard error")
+      ("checkpoint", po::value<string>(), "periodically save the full simulation state (boards, random number generators, counters) to a checkpoint file")
+      ("checkpoint-moves", po::value<long>(), "checkpoint every N moves")
+      ("checkpoint-seconds", po::value<double>(), "checkpoint every T seconds of wall time")
+      ("checkpoint-deltas", po::value<int>(), "between full checkpoints, write up to N incremental checkpoints holding only the units changed since the last")
+      ("checkpoint-fork", "write checkpoints from a forked background process, so the simulation only pauses to fork")
+      ("resume", po::value<string>(), "resume a run from a checkpoint file, continuing exactly as if it had never stopped")
       ;
 
     po::variables_map vm;
@@ -64,15 +102,44 @@ int main (int argc, char** argv) {
     mt19937 mt (seed);
     cerr << "Random seed is " << seed << endl;
 
+    const bool profiling = vm.count("profile") || vm.count("trace");
+    if (profiling)
+      profiler().enable (vm.count("trace"));
+
+    // checkpointing
+    const bool checkpointing = vm.count("checkpoint");
+    const long checkpointMoves = vm.count("checkpoint-moves") ? vm.at("checkpoint-moves").as<long>() : 0;
+    const double checkpointSeconds = vm.count("checkpoint-seconds") ? vm.at("checkpoint-seconds").as<double>() : 0;
+    if ((checkpointMoves > 0 || checkpointSeconds > 0 || vm.count("checkpoint-fork") || vm.count("checkpoint-deltas")) && !checkpointing)
+      throw runtime_error ("Checkpoint period given, but no checkpoint file");
+    if (checkpointing && checkpointMoves <= 0 && checkpointSeconds <= 0)
+      throw runtime_error ("Checkpoint file given, but no checkpoint period");
+    const bool checkpointFork = vm.count("checkpoint-fork");
+    // a forked child of a multithreaded process may only call async-signal-safe functions, so the run must be single-threaded when it forks
+    if (checkpointFork && (vm.count("journal") || (vm.count("log-threads") && vm.at("log-threads").as<int>() > 0)))
+      throw runtime_error ("--checkpoint-fork needs a single-threaded run, so can't be combined with --journal or background --log-threads");
+    const int checkpointDeltas = vm.count("checkpoint-deltas") ? vm.at("checkpoint-deltas").as<int>() : 0;
+    if ((checkpointing || vm.count("resume")) && (vm.count("precision") || vm.count("adaptive-period") || vm.count("observe")))
+      throw runtime_error ("Checkpoints can't yet be combined with --precision, --adaptive-period or --observe");
+    Checkpoint resume;
+    if (vm.count("resume")) {
+      if (vm.count("load") || vm.count("init") || vm.count("density"))
+	throw runtime_error ("--resume restores the board; don't also use --load, --init or --density");
+      resume.load (vm.at("resume").as<string>());
+      cerr << "Resuming from move " << resume.state.at("move").get<long>() << endl;
+    }
+
     // create Board
     Board board;
-    if (vm.count("load")) {
+    if (vm.count("resume"))
+      board = resume.replica[0];
+    else if (vm.count("load") && isBinaryBoardFile (vm.at("load").as<string>()))
+      board = loadBinaryBoard (vm.at("load").as<string>());
+    else if (vm.count("load")) {
       ifstream infile (vm.at("load").as<string>());
       if (!infile)
 	throw runtime_error ("Can't load board file");
-      json j;
-      infile >> j;
-      board = Board::fromJson (j);
+      board = readJsonBoard (infile);
     } else {
       board = Board (vm["xsize"].as<int>(),
 		     vm["ysize"].as<int>(),
@@ -110,73 +177,341 @@ int main (int argc, char** argv) {
     const bool logColors = !vm.count("monochrome");
     const bool logFolds = vm.count("folds");
     const bool logSeqs = vm.count("seqs");
-    const bool countPairs = vm.count("bitmap") || vm.count("csv") || vm.count("json");
+    const bool countPairs = vm.count("bitmap") || vm.count("csv") || vm.count("coo") || vm.count("npy") || vm.count("json");
+    const bool raoBlackwell = vm.count("rao-blackwell");
+    const int rbWindow = vm.at("rb-window").as<int>();
+    if (rbWindow < 1)
+      throw runtime_error ("--rb-window must be at least 1");
+    const int nReplicas = vm.at("replicas").as<int>();
+    if (nReplicas < 1)
+      throw runtime_error ("Need at least one replica");
     if (logFolds)
       board.assertLinear();
 
-    // do the simulation
-    const long moves = vm.at("total-moves").as<long>() + board.unit.size() * vm.at("unit-moves").as<long>();
-    long succeeded = 0, samples = 0;
-    map<Board::IndexPair,long> pairCount;
-    for (long move = 0; move < moves; ++move) {
-      if (board.tryMove (mt))
-	++succeeded;
-      if (move % logPeriod == 0) {
+    // replicas
+    vguard<Board> replica (nReplicas, board);
+    vguard<mt19937> replicaRng (nReplicas, mt);
+    for (int r = 1; r < nReplicas; ++r)
+      replicaRng[r].seed (seed + r);
+    if (vm.count("resume")) {
+      if ((int) resume.replica.size() != nReplicas || resume.state.at("raoBlackwell").get<bool>() != raoBlackwell
+	  || (raoBlackwell && resume.state.value("rbWindow", 2) != rbWindow))
+	throw runtime_error ("Checkpoint was made with a different number of replicas or estimator");
+      // parameters given on the command line override the checkpoint's
+      for (auto& b: resume.replica)
+	b.params = board.params;
+      replica.swap (resume.replica);
+      replicaRng.swap (resume.rng);
+    }
+
+    // convergence monitor
+    unique_ptr<ConvergenceMonitor> monitor;
+    if (vm.count("precision"))
+      monitor.reset (new ConvergenceMonitor (nReplicas, vm.at("precision").as<double>()));
+    unique_ptr<AdaptivePeriod> adaptive;
+    if (vm.count("adaptive-period"))
+      adaptive.reset (new AdaptivePeriod (logPeriod, 3));
+    vguard<double> sampleEnergy (nReplicas), sampleObservables (3);
+    vguard<ConvergenceMonitor::PairWeights> samplePairs (nReplicas);
+
+    // logging pipeline
+    unique_ptr<LogPipeline> logger;
+    if (logFolds || logSeqs) {
+      auto format = [=] (const Board& board, const LogRecord& rec, ostream& out) {
 	if (logFolds)
-	  cout << succeeded
-	       << " (" << fixed << setprecision(1) << (100. * move / moves) << "%) "
-	       << (logColors ? board.coloredFoldString() : board.foldString())
-	       << " " << setw(5) << board.foldEnergy()
-	       << " " << setw(5) << board.unitRadiusOfGyration()
-	       << " (" << to_string_join (board.unitCentroid()) << ")"
-	       << endl;
+	  out << rec.succeeded
+	      << " (" << fixed << setprecision(1) << rec.percent() << "%) "
+	      << (logColors ? board.coloredFoldString() : board.foldString())
+	      << " " << setw(5) << board.foldEnergy()
+	      << " " << setw(5) << board.unitRadiusOfGyration()
+	      << " (" << to_string_join (board.unitCentroid()) << ")"
+	      << '\n';
 	if (logSeqs) {
 	  const auto seqFreqs = board.sequenceFreqs();
-	  cout << succeeded
-	       << " (" << fixed << setprecision(1) << (100. * move / moves) << "%)";
+	  out << rec.succeeded
+	      << " (" << fixed << setprecision(1) << rec.percent() << "%)";
 	  for (auto& sf: seqFreqs)
-	    cout << " " << sf.first << "(" << sf.second << ")";
-	  cout << endl;
+	    out << " " << sf.first << "(" << sf.second << ")";
+	  out << '\n';
+	}
+      };
+      const int logThreads = vm.count("log-threads") ? vm.at("log-threads").as<int>() : (thread::hardware_concurrency() > 1 && !checkpointFork ? 1 : 0);
+      logger.reset (new LogPipeline (format, cout, logThreads, 16, logFolds));
+    }
+
+    // observables
+    ObserverSet observers;
+    if (vm.count("observe"))
+      for (const auto& spec: vm.at("observe").as<vector<string> >())
+	observers.add (spec);
+    const bool observeEvents = observers.wantsEvents();
+    const bool countMoves = vm.count("stats");
+    vguard<MoveCounter> moveCounter (countMoves ? nReplicas : 0);
+
+    // do the simulation
+    const long moves = vm.at("total-moves").as<long>() + board.unit.size() * vm.at("unit-moves").as<long>();
+    long move, nextSample = 0, succeeded = 0, samples = 0;
+    const long validatePeriod = vm.count("validate") ? vm.at("validate").as<long>() : 0;
+    long nextValidate = validatePeriod > 0 ? validatePeriod - 1 : numeric_limits<long>::max();
+    bool converged = false;
+    map<Board::IndexPair,double> pairCount;
+    MoveStats totalStats;
+    double previousSeconds = 0;
+    move = 0;
+    if (vm.count("resume")) {
+      const json& state = resume.state;
+      move = state.at("move").get<long>();
+      nextSample = state.at("nextSample").get<long>();
+      succeeded = state.at("succeeded").get<long>();
+      samples = state.at("samples").get<long>();
+      if (validatePeriod > 0)
+	nextValidate = state.value ("nextValidate", move + validatePeriod - 1);
+      pairCount = pairCountFromJson (state.at("pairCount"));
+      totalStats = moveStatsFromJson (state.at("stats"));
+      previousSeconds = state.at("seconds").get<double>();
+    }
+    unique_ptr<TrajectoryWriter> trajectory;
+    const long trajectoryPeriod = vm.count("trajectory-period") ? vm.at("trajectory-period").as<long>() : logPeriod;
+    if (trajectoryPeriod < 1)
+      throw runtime_error ("Trajectory period must be positive");
+    long nextFrame = numeric_limits<long>::max();
+    if (vm.count("trajectory")) {
+      // a resumed run continues its trajectory, dropping any frames recorded after the checkpoint
+      const string& filename = vm.at("trajectory").as<string>();
+      if (vm.count("resume") && access (filename.c_str(), F_OK) == 0)
+	trajectory.reset (new TrajectoryWriter (filename, replica[0], move));
+      else
+	trajectory.reset (new TrajectoryWriter (filename, replica[0]));
+      nextFrame = (move / trajectoryPeriod + 1) * trajectoryPeriod - 1;  // frames every trajectoryPeriod moves, resumed or not
+    }
+    unique_ptr<JournalWriter> journalWriter;
+    MoveJournal journal;
+    if (vm.count("journal")) {
+      if (observeEvents || checkpointDeltas > 0)
+	throw runtime_error ("--journal can't be combined with event observables or --checkpoint-deltas");
+      const string& filename = vm.at("journal").as<string>();
+      const bool append = vm.count("resume") && access (filename.c_str(), F_OK) == 0;
+      journalWriter.reset (new JournalWriter (filename, replica[0], move, append));
+      journal = MoveJournal (journalWriter.get(), move);
+    }
+    long nextCheckpoint = checkpointMoves > 0 ? move + checkpointMoves - 1 : numeric_limits<long>::max();
+    const auto startTime = chrono::steady_clock::now();
+    auto lastCheckpointTime = startTime;
+    BackgroundCheckpointer checkpointer;
+    uint64_t checkpointBase = 0;
+    int checkpointDelta = -1;  // the first checkpoint is always a full one
+    vguard<DirtyUnitTracker> dirtyTracker;
+    if (checkpointDeltas > 0)
+      for (auto& b: replica) {
+	b.trackDirtyUnits (true);
+	dirtyTracker.push_back (DirtyUnitTracker (&b));
+      }
+    for (; move < moves; ) {
+      // run a block of moves, up to and including the next move after which anything is sampled, observed, recorded or checkpointed
+      const long last = min (min (min (moves - 1, nextValidate), min (nextSample, observers.nextDue())), min (nextCheckpoint, nextFrame));
+      MoveStats stats;
+      {
+	PhaseTimer timer (Profiler::Stepping);
+	const auto stepStart = chrono::steady_clock::now();
+	for (int r = 0; r < nReplicas; ++r)
+	  if (r == 0 && observeEvents) {
+	    observers.events.move = move;
+	    replica[r].run (last + 1 - move, replicaRng[r], stats, observers.events);
+	  } else if (r == 0 && journalWriter)
+	    replica[r].run (last + 1 - move, replicaRng[r], stats, journal);
+	  else if (!dirtyTracker.empty())
+	    replica[r].run (last + 1 - move, replicaRng[r], stats, dirtyTracker[r]);
+	  else if (countMoves)
+	    replica[r].run (last + 1 - move, replicaRng[r], stats, moveCounter[r]);
+	  else
+	    replica[r].run (last + 1 - move, replicaRng[r], stats);
+	stats.seconds = chrono::duration<double> (chrono::steady_clock::now() - stepStart).count();
+      }
+      succeeded += stats.accepted;
+      totalStats += stats;
+      move = last + 1;
+      if (last == nextValidate) {
+	for (const auto& b: replica)
+	  b.assertValid();
+	nextValidate += validatePeriod;
+      }
+      if (last == nextSample) {
+	const Board& board = replica[0];
+	if (logger)
+	  logger->submit (board, LogRecord (last, moves, succeeded));
+	PhaseTimer timer (Profiler::Sampling);
+	if (monitor) {
+	  for (int r = 0; r < nReplicas; ++r) {
+	    samplePairs[r].clear();
+	    if (raoBlackwell)
+	      replica[r].creditPairProbs (samplePairs[r], rbWindow);
+	    else
+	      replica[r].countPairs (samplePairs[r]);
+	    sampleEnergy[r] = replica[r].foldEnergy();
+	  }
+	  monitor->addSample (sampleEnergy, samplePairs);
+	  if ((converged = monitor->converged()))
+	    break;
+	} else if (countPairs) {
+	  for (auto& b: replica)
+	    if (raoBlackwell)
+	      b.creditPairProbs (pairCount, rbWindow);
+	    else
+	      b.countPairs (pairCount);
+	  samples += nReplicas;
+	}
+	if (adaptive) {
+	  sampleObservables[0] = board.foldEnergy();
+	  sampleObservables[1] = board.indexPairs().size();
+	  sampleObservables[2] = board.unitRadiusOfGyration();
+	  if (adaptive->addSample (sampleObservables))
+	    cerr << "Logging period is now " << adaptive->period << " moves" << endl;
+	}
+	nextSample += adaptive ? adaptive->period : logPeriod;
+      }
+      if (!observers.empty()) {
+	PhaseTimer timer (Profiler::Observables);
+	observers.dispatch (replica[0], last);
+      }
+      if (last == nextFrame) {
+	trajectory->write (replica[0], move);
+	nextFrame += trajectoryPeriod;
+      }
+      if (checkpointing && move < moves) {
+	const auto now = chrono::steady_clock::now();
+	const bool due = last == nextCheckpoint
+	  || (checkpointSeconds > 0 && chrono::duration<double> (now - lastCheckpointTime).count() >= checkpointSeconds);
+	if (due && !(checkpointFork && checkpointer.busy())) {
+	  PhaseTimer timer (Profiler::Export);
+	  json state;
+	  state["move"] = move;
+	  state["nextSample"] = nextSample;
+	  state["succeeded"] = succeeded;
+	  state["samples"] = samples;
+	  if (validatePeriod > 0)
+	    state["nextValidate"] = nextValidate;
+	  state["raoBlackwell"] = raoBlackwell;
+	  state["rbWindow"] = rbWindow;
+	  state["pairCount"] = pairCountToJson (pairCount);
+	  state["stats"] = moveStatsToJson (totalStats);
+	  state["seconds"] = previousSeconds + chrono::duration<double> (now - startTime).count();
+	  const bool full = checkpointDelta < 0 || checkpointDelta >= checkpointDeltas;
+	  if (full) {
+	    checkpointBase = checkpointDeltas > 0 ? Checkpoint::newBaseId() : 0;
+	    checkpointDelta = 0;
+	  } else
+	    ++checkpointDelta;
+	  if (journalWriter) {
+	    // end a journal block here, on disk, so that a resumed run can continue the journal from this move
+	    journal.flush();
+	    journalWriter->sync();
+	  }
+	  const string& filename = vm.at("checkpoint").as<string>();
+	  auto write = [&] () {
+	    if (full)
+	      Checkpoint::save (filename, state, replica, replicaRng, checkpointBase);
+	    else
+	      Checkpoint::saveDelta (filename, checkpointDelta, state, replica, replicaRng, checkpointBase);
+	  };
+	  if (checkpointFork)
+	    checkpointer.start (write);
+	  else
+	    write();
+	  for (auto& b: replica)
+	    b.clearDirtyUnits();
+	  lastCheckpointTime = now;
 	}
-	if (countPairs)
-	  for (const auto& ij: board.indexPairs())
-	    ++pairCount[ij];
-	++samples;
+	if (last == nextCheckpoint)
+	  nextCheckpoint += checkpointMoves;
       }
     }
+    checkpointer.finish();
+    observers.finish (replica[0], move);
+    if (trajectory)
+      trajectory->close();
+    if (journalWriter) {
+      journal.flush();
+      journalWriter->finish();
+    }
+    const double seconds = previousSeconds + chrono::duration<double> (chrono::steady_clock::now() - startTime).count();
+    board = replica[0];
+    if (logger) {
+      PhaseTimer timer (Profiler::Logging);
+      logger->finish();
+    }
 
     // report results
+    PhaseTimer exportTimer (Profiler::Export);
     if (moves)
-      cerr << "Tried " << moves << " moves, " << succeeded << " succeeded" << endl;
+      cerr << "Tried " << move * nReplicas << " moves, " << succeeded << " succeeded" << endl;
+
+    if (adaptive)
+      cerr << "Adaptive logging period: " << adaptive->report() << endl;
+
+    if (monitor) {
+      cerr << (converged ? "Converged" : "Did not converge") << " after " << move << " moves per replica: " << monitor->report() << endl;
+      pairCount = monitor->pairWeights();
+      samples = monitor->pairSamples();
+    }
+
+    if (!observers.empty()) {
+      if (vm.count("observations")) {
+	ofstream outfile (vm.at("observations").as<string>());
+	if (!outfile)
+	  throw runtime_error ("Can't save observables to JSON file");
+	outfile << observers.report() << endl;
+      } else
+	cerr << observers.report() << endl;
+    }
+
+    if (countMoves) {
+      json js = totalStats.toJson (seconds);
+      js["replicas"] = nReplicas;
+      ofstream outfile (vm.at("stats").as<string>());
+      if (!outfile)
+	throw runtime_error ("Can't save move statistics to JSON file");
+      outfile << js << endl;
+    }
 
     if (vm.count("bitmap")) {
-      bitmap_image image (board.unit.size(), board.unit.size());
-      for (const auto& ij_n: pairCount) {
-	const int level = (255 * ij_n.second + 128) / samples;
-	image.set_pixel (ij_n.first.first, ij_n.first.second, level, level, level);
-      }
-      image.save_image (vm.at("bitmap").as<string>().c_str());
+      ofstream outfile (vm.at("bitmap").as<string>(), ios::binary);
+      if (!outfile)
+	throw runtime_error ("Can't save basepair probabilities to bitmap file");
+      writePairBitmap (pairCount, samples, board.unit.size(), outfile, vm.count("bitmap-size") ? vm.at("bitmap-size").as<size_t>() : 0);
     }
 
     if (vm.count("csv")) {
-      vguard<vguard<string> > pp (board.unit.size(), vguard<string> (board.unit.size()));
-      for (const auto& ij_n: pairCount)
-	pp[ij_n.first.first][ij_n.first.second] = to_string (ij_n.second / (double) samples);
       ofstream outfile (vm.at("csv").as<string>());
       if (!outfile)
 	throw runtime_error ("Can't save basepair probabilities to CSV file");
-      outfile << "*," << join (board.sequence(), ",") << endl;
-      for (size_t n = 0; n < pp.size(); ++n)
-	outfile << board.unit[n].baseChar() << "," << to_string_join (pp[n], ",") << endl;
+      writePairCsv (board, pairCount, samples, outfile);
+    }
+
+    if (vm.count("coo")) {
+      ofstream outfile (vm.at("coo").as<string>());
+      if (!outfile)
+	throw runtime_error ("Can't save basepair probabilities to sparse CSV file");
+      writePairCoo (pairCount, samples, outfile);
+    }
+
+    if (vm.count("npy")) {
+      ofstream outfile (vm.at("npy").as<string>(), ios::binary);
+      if (!outfile)
+	throw runtime_error ("Can't save basepair probabilities to .npy file");
+      writePairNpy (pairCount, samples, board.unit.size(), outfile);
     }
 
     if (vm.count("json")) {
       json js;
       js["samples"] = samples;
+      if (monitor)
+	js["convergence"] = monitor->report();
+      if (adaptive)
+	js["sampling"] = adaptive->report();
       js["sequence"] = board.sequence();
       for (const auto& ij_n: pairCount) {
 	const string i = to_string(ij_n.first.first), j = to_string(ij_n.first.second);
-	js["prob"][i][j] = ((double) ij_n.second) / samples;
+	js["prob"][i][j] = ij_n.second / samples;
       }
       ofstream outfile (vm.at("json").as<string>());
       if (!outfile)
@@ -185,14 +520,30 @@ int main (int argc, char** argv) {
     }
 
     if (vm.count("save")) {
-      json j = board.toJson();
-      ofstream outfile (vm.at("save").as<string>());
-      if (!outfile)
-	throw runtime_error ("Can't save board file");
-      outfile << j << endl;
-    } else if (!logFolds)
-      cout << board.toJson() << endl;
+      const string& filename = vm.at("save").as<string>();
+      if (vm.count("binary") || (filename.size() > 4 && filename.substr (filename.size() - 4) == ".bin"))
+	saveBinaryBoard (board, filename);
+      else {
+	ofstream outfile (filename);
+	if (!outfile)
+	  throw runtime_error ("Can't save board file");
+	writeJsonBoard (board, outfile);
+	outfile << endl;
+      }
+    } else if (!logFolds && !vm.count("no-board")) {
+      writeJsonBoard (board, cout);
+      cout << endl;
+    }
 
+    exportTimer.stop();
+    if (profiling)
+      cerr << "Profile: " << profiler().report() << endl;
+    if (vm.count("trace")) {
+      ofstream outfile (vm.at("trace").as<string>());
+      if (!outfile)
+	throw runtime_error ("Can't save trace file");
+      profiler().writeTrace (outfile);
+    }
   } catch (const exception& e) {
     cerr << e.what() << endl;
     return EXIT_FAILURE;